@@ -21,6 +21,15 @@
 #endif
 
 #include "ASIO.hpp"
+#include "Varint.hpp"
+#include "FrameParser.hpp"
+#include "Concurrent.hpp"
+
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <algorithm>
 
 boost::asio::io_context *ioContext = NULL;
 boost::asio::io_context& IoContext() {
@@ -29,7 +38,207 @@ boost::asio::io_context& IoContext() {
 	return *ioContext;
 }
 void IoContextPollOne() {
-	IoContext().poll_one();
+	boost::asio::io_context& context = IoContext();
+	if(context.stopped())
+		context.restart();
+	context.poll_one();
+}
+
+
+struct IoThread {
+	IoThread() : work(context.get_executor()), sockets(0) {}
+	
+	boost::asio::io_context context;
+	boost::asio::executor_work_guard<
+		boost::asio::io_context::executor_type> work;
+	std::atomic<uint64_t> sockets;
+	std::thread thread;
+};
+
+static std::vector<std::unique_ptr<IoThread>> ioThreads;
+
+void StartIoThreads(uint32_t threads) {
+	if(!ioThreads.empty())
+		return;
+	if(threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	for(uint32_t i=0; i<threads; ++i) {
+		ioThreads.emplace_back(new IoThread);
+		IoThread* ioThread = ioThreads.back().get();
+		ioThread->thread = std::thread([ioThread]() {
+				ioThread->context.run();
+			});
+	}
+}
+
+void StopIoThreads() {
+	for(auto& ioThread : ioThreads) {
+		ioThread->work.reset();
+		ioThread->context.stop();
+	}
+	for(auto& ioThread : ioThreads)
+		ioThread->thread.join();
+	ioThreads.clear();
+}
+
+uint32_t GetIoThreadsCount() {
+	return ioThreads.size();
+}
+
+boost::asio::io_context& AcquireIoContext() {
+	if(ioThreads.empty())
+		return IoContext();
+	IoThread* best = ioThreads.front().get();
+	for(auto& ioThread : ioThreads)
+		if(ioThread->sockets < best->sockets)
+			best = ioThread.get();
+	++best->sockets;
+	return best->context;
+}
+
+void ReleaseIoContext(boost::asio::io_context* context) {
+	for(auto& ioThread : ioThreads) {
+		if(&ioThread->context == context) {
+			--ioThread->sockets;
+			return;
+		}
+	}
+}
+
+
+bool IsIoThreadContext(const boost::asio::io_context* context) {
+	return context!=NULL && context!=ioContext;
+}
+
+
+void IoEvent::Notify() {
+	condition.notify_all();
+}
+
+
+static std::atomic<WaitPolicy> waitPolicy(WaitPolicy::Park);
+static std::atomic<int> waitSpinus(50);
+static thread_local int adaptiveSpinus = -1;
+
+void SetWaitPolicy(WaitPolicy policy, int spinus) {
+	waitPolicy = policy;
+	waitSpinus = spinus>0 ? spinus : 1;
+}
+
+WaitPolicy GetWaitPolicy() {
+	return waitPolicy;
+}
+
+static std::chrono::steady_clock::time_point BeginSpin(WaitPolicy policy,
+		std::chrono::steady_clock::time_point now,
+		std::chrono::steady_clock::time_point deadline) {
+	const int maxSpinus = waitSpinus;
+	if(adaptiveSpinus < 0 || adaptiveSpinus > maxSpinus)
+		adaptiveSpinus = maxSpinus;
+	if(policy == WaitPolicy::Spin)
+		return deadline;
+	else if(policy == WaitPolicy::SpinThenPark)
+		return now + std::chrono::microseconds(adaptiveSpinus);
+	return now;
+}
+
+static void EndSpin(WaitPolicy policy, bool parked) {
+	if(policy == WaitPolicy::SpinThenPark) {
+		if(parked)
+			adaptiveSpinus >>= 1;
+		else
+			adaptiveSpinus = std::min<int>(waitSpinus, adaptiveSpinus*2+1);
+	}
+}
+
+static bool IoThreadWaitFor(IoEvent& event,
+		const std::function<bool()>& ready, int timeoutms) {
+	std::unique_lock<std::mutex> lock(event.mutex);
+	if(ready())
+		return true;
+	if(timeoutms <= 0)
+		return false;
+	
+	const WaitPolicy policy = waitPolicy;
+	const auto now = std::chrono::steady_clock::now();
+	const auto deadline = now + std::chrono::milliseconds(timeoutms);
+	const auto spinEnd = BeginSpin(policy, now, deadline);
+	while(std::chrono::steady_clock::now() < spinEnd) {
+		lock.unlock();
+		std::this_thread::yield();
+		lock.lock();
+		if(ready()) {
+			EndSpin(policy, false);
+			return true;
+		}
+	}
+	bool result = event.condition.wait_until(lock, deadline, ready);
+	EndSpin(policy, true);
+	return result;
+}
+
+bool IoContextWaitFor(boost::asio::io_context* context, IoEvent& event,
+		const std::function<bool()>& ready, int timeoutms) {
+	if(context == NULL)
+		context = &IoContext();
+	if(IsIoThreadContext(context) &&
+			!context->get_executor().running_in_this_thread())
+		return IoThreadWaitFor(event, ready, timeoutms);
+	
+	auto check = [&]()->bool {
+		std::lock_guard<std::mutex> lock(event.mutex);
+		return ready();
+	};
+	if(check())
+		return true;
+	if(context->stopped())
+		context->restart();
+	context->poll_one();
+	if(check())
+		return true;
+	if(timeoutms <= 0)
+		return false;
+	
+	const WaitPolicy policy = waitPolicy;
+	auto now = std::chrono::steady_clock::now();
+	const auto deadline = now + std::chrono::milliseconds(timeoutms);
+	const auto spinEnd = BeginSpin(policy, now, deadline);
+	
+	bool parked = false;
+	for(;;) {
+		if(check()) {
+			EndSpin(policy, parked);
+			return true;
+		}
+		now = std::chrono::steady_clock::now();
+		if(now >= deadline)
+			break;
+		if(context->stopped())
+			context->restart();
+		if(now < spinEnd) {
+			if(context->poll_one() == 0)
+				std::this_thread::yield();
+		} else {
+			parked = true;
+			if(context->run_one_until(deadline) == 0 && context->stopped()) {
+				// no pending asynchronous operations, nothing to wait on
+				context->restart();
+				std::this_thread::sleep_for(std::min<
+						std::chrono::steady_clock::duration>(deadline-now,
+							std::chrono::milliseconds(1)));
+			}
+		}
+	}
+	EndSpin(policy, true);
+	return check();
+}
+
+void WaitForPendingHandlers(boost::asio::io_context* context, IoEvent& event,
+		const uint32_t& pendingHandlers) {
+	while(!IoContextWaitFor(context, event, [&]()->bool {
+				return pendingHandlers == 0;
+			}, 1000)) {
+	}
 }
 
 
@@ -138,10 +347,7 @@ NumberBuffer& NumberBuffer::operator = (const NumberBuffer& other) {
 }
 
 size_t NumberBuffer::GetOccupiedBytes() const {
-	int i=0;
-	for(; i<10 && bytes[i]&128; ++i) {
-	}
-	return i+1;
+	return varint::Size(value);
 }
 
 const uint8_t* NumberBuffer::GetData() const {
@@ -154,42 +360,14 @@ uint64_t NumberBuffer::GetValue() const {
 
 size_t NumberBuffer::SetValue(uint64_t val) {
 	value = val;
-	for(int i=0; i<10; ++i)
-		bytes[i] = 0;
-	
-	size_t i = 0;
-	if(val == 0) {
-		bytes[0] = 0;
-		return 1;
-	}
-	while(val > 0) {
-		if(val > 127) {
-			bytes[i] = (uint8_t)(val&127) | 128;
-		} else {
-			bytes[i] = (uint8_t)(val&127);
-			break;
-		}
-		val >>= 7;
-		++i;
-	}
-	return i+1;
+	return varint::Encode(val, bytes);
 }
 
 size_t NumberBuffer::SetBytes(const uint8_t* data, size_t max) {
 	value = 0;
-	if(max > 10)
-		max = 10;
-	for(int i=0; i<max; ++i)
-		bytes[i] = data[i];
-	size_t i = 0;
-	for(;; ++i) {
-		if(i >= max)
-			return 0;
-		value |= ((uint64_t)bytes[i]&0x7F) << (i*7);
-		if((bytes[i]&128) == 0)
-			break;
-	}
-	return i+1;
+	const size_t size = varint::Decode(data, max, value);
+	memcpy(bytes, data, size);
+	return size;
 }
 
 void NumberBuffer::Print() {
@@ -252,7 +430,34 @@ void Message::Swap(Message& other) {
 
 
 
+MessageView::MessageView() : data{NULL, 0} {
+}
+
+void MessageView::CopyTo(Message& message) const {
+	message.title.assign(title.data(), title.size());
+	message.data.assign(data.begin(), data.end());
+}
+
+
+
+static concurrent::ptr::pool<FastMessage>& FastMessagePool() {
+	static concurrent::ptr::pool<FastMessage> pool;
+	return pool;
+}
+
+FastMessage* FastMessage::Acquire() {
+	FastMessage* message = FastMessagePool().get();
+	message->SetEmpty();
+	return message;
+}
+
+void FastMessage::Release(FastMessage* message) {
+	if(message)
+		FastMessagePool().release(message);
+}
+
 FastMessage::FastMessage() {
+	__m_next = NULL;
 	SetEmpty();
 }
 
@@ -260,90 +465,87 @@ FastMessage::~FastMessage() {
 }
 
 
-bool FastMessage::SetMessageBody(const char* str, uint64_t strbytes, void* data, uint64_t dataBytes) {
+bool FastMessage::SetMessageBody(const char* str, uint64_t strBytes,
+		const void* data, uint64_t dataBytes) {
+	const uint64_t body = strBytes+1 + dataBytes;
+	const size_t head = varint::Size(body);
+	if(head+body > maxFastMessageSize)
+		return false;
+	varint::Encode(body, buffer);
 	titleLength = strBytes;
 	dataLength = dataBytes;
-	titleAndDataLength = strBytes+1 + dataBytes;
-	NumberBuffer size;
-	uint64_t head = size.SetValue(titleAndDataLength);
-	if(head == 0)
-		return false
-	wholeMessageLength = head+titleAndDataLength;
-	if(wholeMessageLength > maxFastMessageSize)
-		return false;
-	for(int i=0; i<head; ++i)
-		buffer[i] = size.GetData()[i];
-	title = buffer+head;
+	titleAndDataLength = body;
+	wholeMessageLength = head+body;
+	title = (char*)buffer+head;
 	this->data = title+titleLength+1;
 	memcpy(title, str, titleLength);
-	titles[str] = 0;
-	memspy(this->data, data, dataBytes);
+	title[titleLength] = 0;
+	if(dataBytes)
+		memcpy(this->data, data, dataBytes);
+	buffer[wholeMessageLength] = 0;
 	return true;
 }
 
-bool FastMessage::SetMessageBody(const char* str, void* data, uint64_t dataBytes) {
+bool FastMessage::SetMessageBody(const char* str, const void* data,
+		uint64_t dataBytes) {
 	return SetMessageBody(str, strlen(str), data, dataBytes);
 }
 
-bool FastMessage::SetMessageBody(const std::string& str, const void* data, uint64_t dataBytes) {
+bool FastMessage::SetMessageBody(const std::string& str, const void* data,
+		uint64_t dataBytes) {
 	return SetMessageBody(str.c_str(), str.size(), data, dataBytes);
 }
 
-bool FastMessage::SetMessageBody(const std::string& str, const std::vector<uint8_t>& data) {
-	return SetMessageBody(std.c_str(), str.size(), &data.front(), data.size());
+bool FastMessage::SetMessageBody(const std::string& str,
+		const std::vector<uint8_t>& data) {
+	return SetMessageBody(str.c_str(), str.size(), data.data(), data.size());
 }
 
-bool FastMessage::SetMessageBody(const char* str, const std::vector<uint8_t>& data) {
-	return SetMessageBody(str, strlen(str), &data.front(), data.size());
+bool FastMessage::SetMessageBody(const char* str,
+		const std::vector<uint8_t>& data) {
+	return SetMessageBody(str, strlen(str), data.data(), data.size());
 }
 
 
 bool FastMessage::Decode(const void* data, uint64_t dataBytes) {
-	if(PrepareForDecoding(data, dataBytes)) {
-		memcpy(buffer, data, wholeMessageLength);
-		DecodeInternal();
-		return true;
-	}
-	return false;
+	FrameParser parser;
+	parser.Feed((const uint8_t*)data, dataBytes < maxFastMessageSize ?
+			dataBytes : maxFastMessageSize);
+	if(parser.GetState() != FrameParser::complete)
+		return false;
+	memcpy(buffer, data, parser.GetFrameSize());
+	SetDecoded(parser);
+	return true;
 }
 
 bool FastMessage::Decode(const std::vector<uint8_t>& data) {
-	return Decode(&data.front(), data.size());
+	return Decode(data.data(), data.size());
 }
 
 
-void FastMessage::StartWritingBuffer() {
+uint8_t* FastMessage::StartWritingBuffer() {
 	SetEmpty();
+	return buffer;
 }
 
-bool FastMessage::PrepareForDecoding(const void* data, uint64_t dataBytes) {
-	NumberBuffer size;
-	size_t head = size.SetBytes((const uint8_t*)buffer, wholeMessageLength);
-	if(head == 0)
-		return false;
-	wholeMessageLength = head+size.GetValue();
-	if(wholeMessageLength > maxFastMessageSize)
-		return false;
-	if(wholeMessageLength > dataBytes)
+bool FastMessage::Decode() {
+	FrameParser parser;
+	parser.Feed(buffer, maxFastMessageSize);
+	if(parser.GetState() != FrameParser::complete)
 		return false;
-	title = buffer+head;
-	titleAndDataLength = wholeMessageLength-head;
+	SetDecoded(parser);
 	return true;
 }
 
-void FastMessage::DecodeInternal() {
+void FastMessage::SetDecoded(const FrameParser& parser) {
+	wholeMessageLength = parser.GetFrameSize();
+	titleAndDataLength = parser.GetBodySize();
+	titleLength = parser.GetTitleSize();
+	dataLength = wholeMessageLength - parser.GetDataOffset();
+	title = (char*)buffer + parser.GetHeaderSize();
+	data = (char*)buffer + parser.GetDataOffset();
+	// a title without terminator takes the whole body
 	buffer[wholeMessageLength] = 0;
-	titleLength = strlen(title);
-	data = title+titleLength+1;
-	dataLength = titleAndDataLength - (titleLength+1);
-}
-
-bool FastMessage::Decode() {
-	if(PrepareForDecoding(data, dataBytes)) {
-		DecodeInternal();
-		return true;
-	}
-	return false;
 }
 
 
@@ -352,8 +554,8 @@ void FastMessage::SetEmpty() {
 	dataLength = 0;
 	titleAndDataLength = 0;
 	wholeMessageLength = 0;
-	title = buffer;
-	data = buffer;
+	title = (char*)buffer;
+	data = (char*)buffer;
 	buffer[0] = 0;
 }
 
@@ -371,35 +573,43 @@ void CreateOptimalBuffer(const Message& msg,
 	buffer.insert(buffer.end(), msg.data.begin(), msg.data.end());
 }
 
+uint64_t CreateFrameBuffers(const Message& msg, NumberBuffer& header,
+		std::array<boost::asio::const_buffer, 3>& buffers) {
+	uint64_t bodySize = msg.title.size()+1 + msg.data.size();
+	size_t sizebytes = header.SetValue(bodySize);
+	buffers[0] = boost::asio::const_buffer(header.GetData(), sizebytes);
+	buffers[1] = boost::asio::const_buffer(msg.title.c_str(),
+			msg.title.size()+1);
+	buffers[2] = boost::asio::const_buffer(msg.data.data(), msg.data.size());
+	return sizebytes + bodySize;
+}
+
 bool CanReadFullMessage(const uint8_t* buffer, uint64_t bufferSize) {
-	NumberBuffer size;
-	size_t sizebytes = size.SetBytes(buffer, bufferSize);
-	if(sizebytes == 0)
-		return false;
-	if(bufferSize >= size.GetValue()+sizebytes)
-		return true;
-	return false;
+	FrameParser parser;
+	parser.Feed(buffer, bufferSize);
+	return parser.GetState() == FrameParser::complete;
 }
 
 bool CanReadFullMessage(const std::vector<uint8_t>& buffer) {
 	return CanReadFullMessage(&buffer.front(), buffer.size());
 }
 
+void ReadParsedMessage(Message& msg, const uint8_t* frame,
+		const FrameParser& parser) {
+	const char* title = (const char*)frame + parser.GetHeaderSize();
+	msg.title.assign(title, parser.GetTitleSize());
+	msg.data.assign(frame + parser.GetDataOffset(),
+			frame + parser.GetFrameSize());
+}
+
 uint64_t TryReadMessageFromBuffer(Message& msg,
 		uint8_t* buffer, uint64_t bufferSize) {
-	NumberBuffer size;
-	size_t sizebytes = size.SetBytes(buffer, bufferSize);
-	if(sizebytes == 0)
+	FrameParser parser;
+	parser.Feed(buffer, bufferSize);
+	if(parser.GetState() != FrameParser::complete)
 		return 0;
-	if(bufferSize >= size.GetValue()+sizebytes) {
-		msg.title = (char*)buffer+sizebytes;
-		msg.data.clear();
-		msg.data.insert(msg.data.end(),
-				buffer + sizebytes + msg.title.size()+1,
-				buffer + sizebytes + size.GetValue());
-		return sizebytes + size.GetValue();
-	}
-	return 0;
+	ReadParsedMessage(msg, buffer, parser);
+	return parser.GetFrameSize();
 }
 
 uint64_t TryReadMessageFromBuffer(Message& msg,
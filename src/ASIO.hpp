@@ -20,17 +20,105 @@
 #define ASIO_HPP
 
 #include <string>
+#include <string_view>
 #include <map>
 #include <unordered_map>
 #include <vector>
+#include <array>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
 
 #include <cinttypes>
+#include <cstddef>
 
 void IoContextPollOne();
 
+/*
+ *  How threads wait for network events in IoContextWaitFor:
+ *   Park - run io handlers on the calling thread and sleep inside
+ *          io_context::run_one_until when there is nothing to do.
+ *   SpinThenPark - poll for up to spinus microseconds first, then park.
+ *          Spin time adapts per thread: it is halved every time a wait has
+ *          to park and doubled (up to spinus) when spinning was enough.
+ *   Spin - poll until ready or timeout, lowest latency but burns a core.
+ */
+enum class WaitPolicy {
+	Park,
+	SpinThenPark,
+	Spin
+};
+
+void SetWaitPolicy(WaitPolicy policy, int spinus=50);
+WaitPolicy GetWaitPolicy();
+
+/*
+ *  io_context pool. Until StartIoThreads is called every socket uses the
+ *  global IoContext() and io handlers run on whichever thread waits on a
+ *  socket. StartIoThreads creates one io_context per worker thread (threads=0
+ *  means one per hardware thread). Every socket, server and udp socket opened
+ *  afterwards is bound to the context serving the fewest sockets, and all of
+ *  its handlers run on that context's thread only. Start the pool before
+ *  opening sockets and stop it after all of them are closed.
+ */
+void StartIoThreads(uint32_t threads=0);
+void StopIoThreads();
+uint32_t GetIoThreadsCount();
+
+/*
+ *  Guards the state one socket shares between its io handlers and the threads
+ *  using it. Handlers call Notify after changing anything a waiter may be
+ *  waiting for.
+ */
+class IoEvent {
+public:
+	void Notify();
+	
+	std::mutex mutex;
+	std::condition_variable condition;
+};
+
+/*
+ *  Storage for the state of one asynchronous operation at a time. Handlers
+ *  wrapped with BindHandlerMemory keep their operation there instead of on
+ *  the heap, which asio only avoids by itself for operations started on an
+ *  io thread. A second concurrent or a bigger operation falls back to
+ *  operator new.
+ */
+class HandlerMemory {
+public:
+	
+	const static size_t capacity = 1024;
+	
+	HandlerMemory() : used(false) {}
+	HandlerMemory(const HandlerMemory&) = delete;
+	HandlerMemory& operator =(const HandlerMemory&) = delete;
+	
+	void* Allocate(size_t size) {
+		if(!used && size <= capacity) {
+			used = true;
+			return storage;
+		}
+		return ::operator new(size);
+	}
+	
+	void Deallocate(void* pointer) {
+		if(pointer == storage)
+			used = false;
+		else
+			::operator delete(pointer);
+	}
+	
+private:
+	
+	alignas(std::max_align_t) uint8_t storage[capacity];
+	bool used;
+};
+
 #ifdef CPP_FILES_CPP
 
 #include <boost/asio/buffer.hpp>
+#include <boost/asio/post.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/ip/udp.hpp>
 #include <boost/asio/ssl.hpp>
@@ -38,11 +126,106 @@ void IoContextPollOne();
 extern "C" boost::asio::io_context *ioContext;
 boost::asio::io_context& IoContext();
 
+// least loaded pool context, or IoContext() when no io threads are running
+boost::asio::io_context& AcquireIoContext();
+void ReleaseIoContext(boost::asio::io_context* context);
+bool IsIoThreadContext(const boost::asio::io_context* context);
+
+template<typename T>
+class HandlerAllocator {
+public:
+	
+	typedef T value_type;
+	
+	explicit HandlerAllocator(HandlerMemory& memory) : memory(&memory) {}
+	template<typename U>
+	HandlerAllocator(const HandlerAllocator<U>& other) :
+		memory(other.memory) {}
+	
+	T* allocate(size_t count) {
+		return (T*)memory->Allocate(sizeof(T)*count);
+	}
+	
+	void deallocate(T* pointer, size_t) {
+		memory->Deallocate(pointer);
+	}
+	
+	bool operator == (const HandlerAllocator& other) const {
+		return memory == other.memory;
+	}
+	bool operator != (const HandlerAllocator& other) const {
+		return memory != other.memory;
+	}
+	
+	HandlerMemory* memory;
+};
+
+// handler whose associated allocator takes memory from a HandlerMemory
+template<typename Handler>
+class MemoryBoundHandler {
+public:
+	
+	typedef HandlerAllocator<Handler> allocator_type;
+	
+	MemoryBoundHandler(HandlerMemory& memory, Handler handler) :
+		memory(&memory), handler(handler) {}
+	
+	allocator_type get_allocator() const noexcept {
+		return allocator_type(*memory);
+	}
+	
+	template<typename... Args>
+	void operator()(Args&&... args) {
+		handler(std::forward<Args>(args)...);
+	}
+	
+private:
+	
+	HandlerMemory* memory;
+	Handler handler;
+};
+
+template<typename Handler>
+MemoryBoundHandler<Handler> BindHandlerMemory(HandlerMemory& memory,
+		Handler handler) {
+	return MemoryBoundHandler<Handler>(memory, handler);
+}
+
+/*
+ *  Runs function with event.mutex locked on the io thread of a pool context,
+ *  so an io object (and its ssl engine) is only ever used by one thread. For
+ *  the global context, or when already on that io thread, function is called
+ *  directly and the caller must hold event.mutex. pendingHandlers counts the
+ *  posted call until it has run. The posted call is kept in memory when
+ *  given.
+ */
+template<typename F>
+void RunOnIoThread(boost::asio::io_context* context, IoEvent& event,
+		uint32_t& pendingHandlers, F function, HandlerMemory* memory=NULL) {
+	if(!IsIoThreadContext(context) ||
+			context->get_executor().running_in_this_thread()) {
+		function();
+		return;
+	}
+	++pendingHandlers;
+	auto call = [&event, &pendingHandlers, function]() {
+			std::lock_guard<std::mutex> lock(event.mutex);
+			--pendingHandlers;
+			function();
+			event.Notify();
+		};
+	if(memory)
+		boost::asio::post(*context, BindHandlerMemory(*memory, call));
+	else
+		boost::asio::post(*context, call);
+}
+
 #else
 
 namespace boost {
 	namespace asio {
 		class io_context;
+		class const_buffer;
 		namespace ip {
 			namespace tcp {
 				class socket;
@@ -64,6 +247,27 @@ namespace boost {
 
 #endif
 
+/*
+ *  Waits until ready() returns true or timeoutms milliseconds of wall time
+ *  (steady clock) elapse. ready() is always called with event.mutex locked,
+ *  the caller must not hold it. For the global context (or when called from
+ *  the io thread of the pool context itself) io handlers are run on the
+ *  calling thread meanwhile, with timeoutms<=0 they are polled only once.
+ *  Otherwise the thread sleeps on event.condition. Returns the last result of
+ *  ready().
+ */
+bool IoContextWaitFor(boost::asio::io_context* context, IoEvent& event,
+		const std::function<bool()>& ready, int timeoutms);
+
+/*
+ *  Waits without a time limit until pendingHandlers drops to zero. Closing
+ *  sockets use it after cancelling all of their operations: aborted
+ *  handlers still refer to the socket, so it cannot be freed before every
+ *  one of them ran.
+ */
+void WaitForPendingHandlers(boost::asio::io_context* context, IoEvent& event,
+		const uint32_t& pendingHandlers);
+
 #include <Debug.hpp>
 
 class BasicSocket {
@@ -140,27 +344,69 @@ public:
 	std::vector<uint8_t> data;
 };
 
+struct ByteSpan {
+	const uint8_t* begin() const { return data; }
+	const uint8_t* end() const { return data+size; }
+	bool empty() const { return size == 0; }
+	
+	const uint8_t* data;
+	uint64_t size;
+};
+
+/*
+ *  Non-owning view of a received message. Title and data point directly into
+ *  the receive storage of a socket and stay valid only until the message is
+ *  consumed or released on that socket.
+ */
+class MessageView {
+public:
+	
+	MessageView();
+	
+	void CopyTo(Message& message) const;
+	
+	std::string_view title;
+	ByteSpan data;
+};
+
+class FrameParser;
+
+/*
+ *  Message kept in wire format (varint body size, zero terminated title,
+ *  data) in a fixed buffer, for frames of up to maxFastMessageSize bytes.
+ *  Sockets send it and receive into it with plain copies, so a loop reusing
+ *  the same instances does not allocate. Instances are too big for the stack:
+ *  take them with Acquire and give them back with Release, they are kept in
+ *  a concurrent pool shared by all threads. title and data point into
+ *  buffer, title is always zero terminated.
+ */
 class FastMessage {
 public:
 	
 	const static uint64_t maxFastMessageSize = 64*1024;
 	
+	static FastMessage* Acquire();
+	static void Release(FastMessage* message);
+	
 	FastMessage();
 	~FastMessage();
 	
-	bool SetMessageBody(const char* str, uint64_t strBytes, void* data, uint64_t dataBytes);
-	bool SetMessageBody(const char* str, void* data, uint64_t dataBytes);
-	bool SetMessageBody(const std::string& str, const void* data, uint64_t dataBytes);
-	bool SetMessageBody(const std::string& str, const std::vector<uint8_t>& data);
+	bool SetMessageBody(const char* str, uint64_t strBytes, const void* data,
+			uint64_t dataBytes);
+	bool SetMessageBody(const char* str, const void* data, uint64_t dataBytes);
+	bool SetMessageBody(const std::string& str, const void* data,
+			uint64_t dataBytes);
+	bool SetMessageBody(const std::string& str,
+			const std::vector<uint8_t>& data);
 	bool SetMessageBody(const char* str, const std::vector<uint8_t>& data);
 	
+	// copies a whole frame from data
 	bool Decode(const void* data, uint64_t dataBytes);
 	bool Decode(const std::vector<uint8_t>& data);
 	
-	void StartWritingBuffer();
-	bool PrepareForDecoding(const void* data, uint64_t dataBytes);
-	void DecodeInternal();
-	void Decode();
+	// the frame may also be written straight into buffer and then decoded
+	uint8_t* StartWritingBuffer();
+	bool Decode();
 	
 	void SetEmpty();
 	
@@ -172,6 +418,12 @@ public:
 	char* title;
 	char* data;
 	uint8_t buffer[maxFastMessageSize+1];
+	
+	FastMessage* __m_next; // link in the pool
+	
+private:
+	
+	void SetDecoded(const FrameParser& parser);
 };
 
 template<typename T1, typename T2>
@@ -262,8 +514,20 @@ public:
 };
 
 void CreateOptimalBuffer(const Message& msg, std::vector<uint8_t>& buffer);
+#ifdef CPP_FILES_CPP
+/*
+ *  Describes the framed msg as header, title (with terminating zero) and
+ *  payload buffers for a gather write, without copying anything. header has
+ *  to outlive buffers. Returns the whole frame size.
+ */
+uint64_t CreateFrameBuffers(const Message& msg, NumberBuffer& header,
+		std::array<boost::asio::const_buffer, 3>& buffers);
+#endif
 bool CanReadFullMessage(const uint8_t* buffer, uint64_t bufferSize);
 bool CanReadFullMessage(const std::vector<uint8_t>& buffer);
+// copies the frame that parser has just completed, frame points at its header
+void ReadParsedMessage(Message& msg, const uint8_t* frame,
+		const FrameParser& parser);
 uint64_t TryReadMessageFromBuffer(Message& msg,
 		uint8_t* buffer,
 		uint64_t bufferSize);
@@ -350,12 +350,14 @@ namespace concurrent {
 			}
 			
 			inline T* pop() {
+				// next has to be read under the lock too, otherwise another
+				// pop could take value and push it back meanwhile (ABA)
+				std::lock_guard<std::mutex> lock(mutex);
 				for(;;) {
 					T* value = stack.first;
 					if(value == NULL)
 						return NULL;
 					T* next = value->__m_next;
-					std::lock_guard<std::mutex> lock(mutex);
 					if(stack.first.compare_exchange_strong(value, next)) {
 						return value;
 					}
@@ -0,0 +1,182 @@
+/*
+ *  This file is part of ICon3. Please see README for details.
+ *  Copyright (C) 2020 Marek Zalewski aka Drwalin
+ *
+ *  ICon3 is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ICon3 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAME_PARSER_HPP
+#define FRAME_PARSER_HPP
+
+#include "Varint.hpp"
+
+#include <cinttypes>
+#include <cstddef>
+#include <cstring>
+
+/*
+ *  Incremental parser of a single frame: varint body size, then the body
+ *  made of a zero terminated title and the payload. Bytes are fed in the
+ *  order they arrive, each of them exactly once, and the parser keeps the
+ *  partially decoded header and the title search between calls, so a frame
+ *  split over many reads is never parsed again from its start. Feed never
+ *  consumes bytes of the next frame; after a frame is complete, Reset
+ *  starts the next one.
+ *
+ *  A header that does not end within varint::maxBytes bytes makes the
+ *  parser invalid, the stream cannot be resynchronized after that.
+ */
+class FrameParser {
+public:
+	
+	enum State : uint8_t {
+		awaitingHeader,
+		awaitingBody,
+		complete,
+		invalid
+	};
+	
+	FrameParser() {
+		Reset();
+	}
+	
+	void Reset() {
+		bodySize = 0;
+		bodyReceived = 0;
+		titleSize = 0;
+		headerSize = 0;
+		state = awaitingHeader;
+		titleFound = false;
+	}
+	
+	// Returns the bytes taken from data, at most up to the end of the frame.
+	size_t Feed(const uint8_t* data, size_t size) {
+		size_t used = 0;
+		if(state == awaitingHeader)
+			used = FeedHeader(data, size);
+		if(state == awaitingBody)
+			used += FeedBody(data+used, size-used);
+		return used;
+	}
+	
+	State GetState() const {
+		return state;
+	}
+	
+	// Bytes that still have to arrive before the frame is complete. While the
+	// header is incomplete only the next byte is known to be needed.
+	uint64_t GetMissingBytes() const {
+		switch(state) {
+			case awaitingHeader:
+				return 1;
+			case awaitingBody:
+				return bodySize - bodyReceived;
+			default:
+				return 0;
+		}
+	}
+	
+	uint32_t GetHeaderSize() const {
+		return headerSize;
+	}
+	
+	uint64_t GetBodySize() const {
+		return bodySize;
+	}
+	
+	uint64_t GetFrameSize() const {
+		return headerSize + bodySize;
+	}
+	
+	// header and body bytes fed so far
+	uint64_t GetReceivedBytes() const {
+		return headerSize + bodyReceived;
+	}
+	
+	// Title length without the terminating zero. Valid once the frame is
+	// complete; a body without zero is all title.
+	uint64_t GetTitleSize() const {
+		return titleSize;
+	}
+	
+	// offset of the payload from the start of the frame
+	uint64_t GetDataOffset() const {
+		return DataOffset(headerSize, bodySize, titleSize);
+	}
+	
+	// The same for a frame found whole by varint::ScanFrames, without
+	// feeding it through a parser.
+	static uint64_t TitleSize(const uint8_t* body, uint64_t bodySize) {
+		const void* end = memchr(body, 0, bodySize);
+		return end ? (const uint8_t*)end - body : bodySize;
+	}
+	
+	static uint64_t DataOffset(uint64_t headerSize, uint64_t bodySize,
+			uint64_t titleSize) {
+		const uint64_t titleBytes = titleSize < bodySize ? titleSize+1 :
+			bodySize;
+		return headerSize + titleBytes;
+	}
+	
+private:
+	
+	size_t FeedHeader(const uint8_t* data, size_t size) {
+		if(headerSize == 0 && size >= varint::maxBytes) {
+			headerSize = varint::Decode(data, size, bodySize);
+			state = headerSize ? awaitingBody : invalid;
+			return headerSize;
+		}
+		for(size_t i=0; i<size; ++i) {
+			bodySize |= ((uint64_t)data[i]&0x7F) << (headerSize*7);
+			++headerSize;
+			if((data[i]&0x80) == 0) {
+				state = awaitingBody;
+				return i+1;
+			}
+			if(headerSize == varint::maxBytes) {
+				state = invalid;
+				return i+1;
+			}
+		}
+		return size;
+	}
+	
+	size_t FeedBody(const uint8_t* data, size_t size) {
+		const uint64_t left = bodySize - bodyReceived;
+		const size_t take = left < size ? left : size;
+		if(!titleFound) {
+			const void* end = memchr(data, 0, take);
+			if(end) {
+				titleSize = bodyReceived + ((const uint8_t*)end - data);
+				titleFound = true;
+			} else {
+				titleSize = bodyReceived + take;
+			}
+		}
+		bodyReceived += take;
+		if(bodyReceived == bodySize)
+			state = complete;
+		return take;
+	}
+	
+	uint64_t bodySize;
+	uint64_t bodyReceived;
+	uint64_t titleSize;
+	uint32_t headerSize;
+	State state;
+	bool titleFound;
+};
+
+#endif
+
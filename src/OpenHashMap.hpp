@@ -0,0 +1,149 @@
+/*
+ *  This file is part of ICon3. Please see README for details.
+ *  Copyright (C) 2020 Marek Zalewski aka Drwalin
+ *
+ *  ICon3 is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ICon3 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef OPEN_HASH_MAP_HPP
+#define OPEN_HASH_MAP_HPP
+
+#include <cinttypes>
+#include <cstddef>
+
+#include <vector>
+
+/*
+ *  Open addressing hash map with linear probing. All slots live in a single
+ *  array of power of two size that is kept at most 3/4 full, and erasing
+ *  shifts the following entries back instead of leaving tombstones, so
+ *  lookups stop at the first empty slot. Memory is allocated only when the
+ *  table grows. Pointers returned by Find stay valid until the next Insert
+ *  or Erase.
+ */
+template<typename K, typename V, typename Hash>
+class OpenHashMap {
+public:
+	
+	const static size_t minCapacity = 16;
+	
+	OpenHashMap() : count(0) {
+	}
+	
+	V* Find(const K& key) {
+		if(count == 0)
+			return NULL;
+		const size_t mask = slots.size()-1;
+		for(size_t i=Hash()(key)&mask;; i=(i+1)&mask) {
+			Slot& slot = slots[i];
+			if(!slot.used)
+				return NULL;
+			if(slot.key == key)
+				return &slot.value;
+		}
+	}
+	
+	const V* Find(const K& key) const {
+		return const_cast<OpenHashMap*>(this)->Find(key);
+	}
+	
+	// inserts or overwrites
+	V& Insert(const K& key, const V& value) {
+		if((count+1)*4 > slots.size()*3)
+			Rehash(slots.empty() ? minCapacity : slots.size()*2);
+		const size_t mask = slots.size()-1;
+		size_t i = Hash()(key)&mask;
+		for(; slots[i].used; i=(i+1)&mask) {
+			if(slots[i].key == key) {
+				slots[i].value = value;
+				return slots[i].value;
+			}
+		}
+		slots[i].key = key;
+		slots[i].value = value;
+		slots[i].used = true;
+		++count;
+		return slots[i].value;
+	}
+	
+	bool Erase(const K& key) {
+		if(count == 0)
+			return false;
+		const size_t mask = slots.size()-1;
+		size_t i = Hash()(key)&mask;
+		for(;; i=(i+1)&mask) {
+			if(!slots[i].used)
+				return false;
+			if(slots[i].key == key)
+				break;
+		}
+		// move back every following entry that would not be reachable
+		// through the emptied slot anymore
+		for(size_t j=(i+1)&mask; slots[j].used; j=(j+1)&mask) {
+			const size_t home = Hash()(slots[j].key)&mask;
+			if(((j-home)&mask) >= ((j-i)&mask)) {
+				slots[i] = slots[j];
+				i = j;
+			}
+		}
+		slots[i].used = false;
+		--count;
+		return true;
+	}
+	
+	void Clear() {
+		for(Slot& slot : slots)
+			slot.used = false;
+		count = 0;
+	}
+	
+	size_t Size() const {
+		return count;
+	}
+	
+	bool Empty() const {
+		return count == 0;
+	}
+	
+	template<typename F>
+	void ForEach(F function) const {
+		for(const Slot& slot : slots)
+			if(slot.used)
+				function(slot.key, slot.value);
+	}
+	
+private:
+	
+	struct Slot {
+		Slot() : used(false) {}
+		K key;
+		V value;
+		bool used;
+	};
+	
+	void Rehash(size_t capacity) {
+		std::vector<Slot> old(capacity);
+		old.swap(slots);
+		count = 0;
+		for(const Slot& slot : old)
+			if(slot.used)
+				Insert(slot.key, slot.value);
+	}
+	
+	std::vector<Slot> slots;
+	size_t count;
+};
+
+#endif
+
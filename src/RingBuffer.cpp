@@ -0,0 +1,160 @@
+/*
+ *  This file is part of ICon3. Please see README for details.
+ *  Copyright (C) 2020 Marek Zalewski aka Drwalin
+ *
+ *  ICon3 is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ICon3 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "RingBuffer.hpp"
+
+#include <cstring>
+
+RingBuffer::RingBuffer() :
+	storage(NULL), capacity(0), configuredCapacity(defaultCapacity),
+	readOffset(0), writeOffset(0), writePending(false), pinned(false) {
+}
+
+RingBuffer::RingBuffer(uint64_t capacity) :
+	storage(NULL), capacity(0),
+	configuredCapacity(capacity ? capacity : defaultCapacity),
+	readOffset(0), writeOffset(0), writePending(false), pinned(false) {
+}
+
+RingBuffer::~RingBuffer() {
+	Release();
+}
+
+
+void RingBuffer::SetCapacity(uint64_t capacity) {
+	if(capacity == 0)
+		capacity = defaultCapacity;
+	configuredCapacity = capacity;
+}
+
+uint64_t RingBuffer::GetCapacity() const {
+	return storage ? capacity : configuredCapacity;
+}
+
+
+uint64_t RingBuffer::Size() const {
+	return writeOffset-readOffset;
+}
+
+bool RingBuffer::Empty() const {
+	return writeOffset == readOffset;
+}
+
+uint8_t* RingBuffer::Data() {
+	return storage+readOffset;
+}
+
+const uint8_t* RingBuffer::Data() const {
+	return storage+readOffset;
+}
+
+void RingBuffer::Consume(uint64_t bytes) {
+	if(bytes >= Size()) {
+		readOffset = writeOffset;
+		if(!writePending && !pinned) {
+			readOffset = 0;
+			writeOffset = 0;
+			if(storage && capacity != configuredCapacity)
+				Reallocate(configuredCapacity);
+		}
+	} else {
+		readOffset += bytes;
+	}
+}
+
+
+uint8_t* RingBuffer::PrepareWrite(uint64_t minBytes) {
+	writePending = true;
+	if(storage == NULL)
+		Reallocate(configuredCapacity);
+	if(pinned)
+		return storage+writeOffset;
+	if(Empty()) {
+		readOffset = 0;
+		writeOffset = 0;
+	}
+	if(capacity-writeOffset < minBytes) {
+		uint64_t size = Size();
+		if(capacity-size >= minBytes) {
+			memmove(storage, storage+readOffset, size);
+			readOffset = 0;
+			writeOffset = size;
+		} else {
+			uint64_t newCapacity = capacity;
+			while(newCapacity-size < minBytes)
+				newCapacity <<= 1;
+			Reallocate(newCapacity);
+		}
+	}
+	return storage+writeOffset;
+}
+
+uint64_t RingBuffer::GetWriteSpace() const {
+	return capacity-writeOffset;
+}
+
+void RingBuffer::CommitWrite(uint64_t bytes) {
+	writeOffset += bytes;
+	writePending = false;
+}
+
+
+void RingBuffer::Pin() {
+	pinned = true;
+}
+
+void RingBuffer::Unpin() {
+	pinned = false;
+}
+
+bool RingBuffer::IsPinned() const {
+	return pinned;
+}
+
+
+void RingBuffer::Clear() {
+	Consume(Size());
+}
+
+void RingBuffer::Release() {
+	if(storage) {
+		delete[] storage;
+		storage = NULL;
+	}
+	capacity = 0;
+	readOffset = 0;
+	writeOffset = 0;
+	writePending = false;
+	pinned = false;
+}
+
+
+void RingBuffer::Reallocate(uint64_t newCapacity) {
+	uint64_t size = Size();
+	uint8_t* newStorage = new uint8_t[newCapacity];
+	if(storage) {
+		if(size)
+			memcpy(newStorage, storage+readOffset, size);
+		delete[] storage;
+	}
+	storage = newStorage;
+	capacity = newCapacity;
+	readOffset = 0;
+	writeOffset = size;
+}
+
@@ -0,0 +1,86 @@
+/*
+ *  This file is part of ICon3. Please see README for details.
+ *  Copyright (C) 2020 Marek Zalewski aka Drwalin
+ *
+ *  ICon3 is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ICon3 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RING_BUFFER_HPP
+#define RING_BUFFER_HPP
+
+#include <cinttypes>
+
+/*
+ *  Contiguous receive ring. Stored bytes always occupy one continuous range,
+ *  so frames can be parsed in place. Consumed bytes are never moved: read and
+ *  write offsets are rewound when the ring becomes empty, and the unconsumed
+ *  bytes (any number of complete frames not popped yet, plus a partial one)
+ *  are moved to the front only when there is not enough free space after
+ *  them. Storage grows only when a single write request does not fit into
+ *  the whole ring, and goes back to the configured capacity (SetCapacity)
+ *  the next time the ring becomes empty.
+ *
+ *  Between PrepareWrite and CommitWrite the write region stays where it is,
+ *  so it may be handed to a pending asynchronous read. While the ring is
+ *  pinned, stored bytes are never moved either, and PrepareWrite returns only
+ *  the free space that already exists behind them.
+ */
+class RingBuffer {
+public:
+	
+	const static uint64_t defaultCapacity = 1024*1024;
+	
+	RingBuffer();
+	RingBuffer(uint64_t capacity);
+	~RingBuffer();
+	RingBuffer(RingBuffer&&) = delete;
+	RingBuffer(const RingBuffer&) = delete;
+	RingBuffer& operator =(const RingBuffer&) = delete;
+	
+	void SetCapacity(uint64_t capacity);
+	uint64_t GetCapacity() const;
+	
+	uint64_t Size() const;
+	bool Empty() const;
+	uint8_t* Data();
+	const uint8_t* Data() const;
+	void Consume(uint64_t bytes);
+	
+	// ensures at least minBytes of contiguous free space after stored data
+	uint8_t* PrepareWrite(uint64_t minBytes);
+	uint64_t GetWriteSpace() const;
+	void CommitWrite(uint64_t bytes);
+	
+	void Pin();
+	void Unpin();
+	bool IsPinned() const;
+	
+	void Clear();
+	void Release();
+	
+private:
+	
+	void Reallocate(uint64_t newCapacity);
+	
+	uint8_t* storage;
+	uint64_t capacity;
+	uint64_t configuredCapacity;
+	uint64_t readOffset;
+	uint64_t writeOffset;
+	bool writePending;
+	bool pinned;
+};
+
+#endif
+
@@ -28,6 +28,7 @@
 #include <functional>
 #include <memory>
 #include <thread>
+#include <chrono>
 
 #include <cstring>
 #include <ctime>
@@ -38,24 +39,198 @@
 #include <boost/asio/buffer.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/ssl.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <openssl/ssl.h>
 
 namespace ssl {
 	
+	// index of the session cache key in SSL ex data, and of the owning
+	// ClientContext in SSL_CTX ex data
+	static int SessionKeyIndex() {
+		static int index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+		return index;
+	}
+	static int ClientContextIndex() {
+		static int index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL,
+				NULL);
+		return index;
+	}
+	
+	ClientContext::ClientContext() {
+		sslContext = new boost::asio::ssl::context(
+				boost::asio::ssl::context::sslv23);
+		maxSessions = defaultMaxCachedSessions;
+		valid = false;
+		SSL_CTX* ctx = sslContext->native_handle();
+		SSL_CTX_set_ex_data(ctx, ClientContextIndex(), this);
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT
+				| SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ctx, &ClientContext::NewSession);
+	}
+	
+	ClientContext::ClientContext(const char* certificateFile) :
+		ClientContext() {
+		LoadVerifyFile(certificateFile);
+	}
+	
+	ClientContext::~ClientContext() {
+		ClearSessions();
+		delete sslContext;
+	}
+	
+	ClientContext* ClientContext::Shared(const char* certificateFile) {
+		static std::mutex mutex;
+		static std::unordered_map<std::string,
+			std::unique_ptr<ClientContext>> contexts;
+		std::lock_guard<std::mutex> lock(mutex);
+		std::unique_ptr<ClientContext>& context = contexts[certificateFile];
+		if(!context || !context->Valid())
+			context.reset(new ClientContext(certificateFile));
+		return context.get();
+	}
+	
+	bool ClientContext::LoadVerifyFile(const char* certificateFile) {
+		boost::system::error_code err;
+		sslContext->load_verify_file(certificateFile, err);
+		if(err) {
+			fprintf(stderr, "\n Failed to load %s: %s", certificateFile,
+					err.message().c_str());
+			return false;
+		}
+		valid = true;
+		return true;
+	}
+	
+	bool ClientContext::Valid() const {
+		return valid;
+	}
+	
+	boost::asio::ssl::context& ClientContext::GetContext() {
+		return *sslContext;
+	}
+	
+	void ClientContext::SetMaxCachedSessions(uint32_t maxSessions) {
+		std::lock_guard<std::mutex> lock(mutex);
+		this->maxSessions = maxSessions;
+	}
+	
+	void ClientContext::ClearSessions() {
+		std::lock_guard<std::mutex> lock(mutex);
+		for(auto& it : sessions)
+			SSL_SESSION_free(it.second.session);
+		sessions.clear();
+		storeOrder.clear();
+	}
+	
+	void ClientContext::ResumeSession(ssl_st* ssl, const std::string* key) {
+		SSL_set_ex_data(ssl, SessionKeyIndex(), (void*)key);
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = sessions.find(*key);
+		if(it != sessions.end()) {
+			if(SSL_SESSION_is_resumable(it->second.session))
+				SSL_set_session(ssl, it->second.session);
+			else {
+				SSL_SESSION_free(it->second.session);
+				storeOrder.erase(it->second.stored);
+				sessions.erase(it);
+			}
+		}
+	}
+	
+	int ClientContext::NewSession(ssl_st* ssl, ssl_session_st* session) {
+		ClientContext* self = (ClientContext*)SSL_CTX_get_ex_data(
+				SSL_get_SSL_CTX(ssl), ClientContextIndex());
+		const std::string* key = (const std::string*)SSL_get_ex_data(ssl,
+				SessionKeyIndex());
+		if(self == NULL || key == NULL)
+			return 0;
+		self->StoreSession(*key, session);
+		// the cache keeps the reference
+		return 1;
+	}
+	
+	void ClientContext::StoreSession(const std::string& key,
+			ssl_session_st* session) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = sessions.find(key);
+		if(it != sessions.end()) {
+			SSL_SESSION_free(it->second.session);
+			it->second.session = session;
+			storeOrder.splice(storeOrder.end(), storeOrder,
+					it->second.stored);
+			return;
+		}
+		if(maxSessions == 0) {
+			SSL_SESSION_free(session);
+			return;
+		}
+		while(sessions.size() >= maxSessions) {
+			auto oldest = sessions.find(storeOrder.front());
+			SSL_SESSION_free(oldest->second.session);
+			sessions.erase(oldest);
+			storeOrder.pop_front();
+		}
+		storeOrder.emplace_back(key);
+		sessions.emplace(key, CachedSession{session,
+				std::prev(storeOrder.end())});
+	}
+	
+	
+	
 	Socket::Socket() {
 	}
 	
 	Socket::~Socket() {
+		Close();
 	}
 	
 	bool Socket::Send(const std::vector<uint8_t>& buffer) {
 		return SocketBase::Send(buffer);
 	}
+	bool Socket::Send(std::vector<uint8_t>&& buffer) {
+		return SocketBase::Send(std::move(buffer));
+	}
 	bool Socket::Send(const Message& msg) {
 		return SocketBase::Send(msg);
 	}
+	bool Socket::Send(Message&& msg) {
+		return SocketBase::Send(std::move(msg));
+	}
+	bool Socket::Send(const FastMessage& msg) {
+		return SocketBase::Send(msg);
+	}
+	bool Socket::Flush(int timeoutms) {
+		return SocketBase::Flush(timeoutms);
+	}
+	uint64_t Socket::GetQueuedSendBytes() const {
+		return SocketBase::GetQueuedSendBytes();
+	}
+	bool Socket::HasSendFailed() const {
+		return SocketBase::HasSendFailed();
+	}
+	void Socket::SetSendCallback(
+			std::function<void(bool success, uint64_t bytes)> callback) {
+		SocketBase::SetSendCallback(callback);
+	}
 	bool Socket::TryPopMessage(Message& message, int timeoutms) {
 		return SocketBase::TryPopMessage(message, timeoutms);
 	}
+	bool Socket::TryPopMessage(FastMessage& message, int timeoutms) {
+		return SocketBase::TryPopMessage(message, timeoutms);
+	}
+	bool Socket::TryPeekMessage(MessageView& view, int timeoutms) {
+		return SocketBase::TryPeekMessage(view, timeoutms);
+	}
+	void Socket::ConsumeMessage() {
+		SocketBase::ConsumeMessage();
+	}
+	void Socket::ReleaseMessage() {
+		SocketBase::ReleaseMessage();
+	}
+	void Socket::SetReceiveBufferCapacity(uint64_t bytes) {
+		SocketBase::SetReceiveBufferCapacity(bytes);
+	}
 	void Socket::GetMessageCompletition(uint64_t&recvd, uint64_t& required) {
 		SocketBase::GetMessageCompletition(recvd, required);
 	}
@@ -66,64 +241,175 @@ namespace ssl {
 		return SocketBase::HasMessage();
 	}
 	void Socket::Close() {
+		if(Valid() && !HasSendFailed()) {
+			Flush(asio::closeFlushTimeoutms);
+			// without close_notify OpenSSL would drop the session from
+			// the caches, a quiet shutdown keeps it resumable
+			std::lock_guard<std::mutex> lock(ioEvent.mutex);
+			RunOnIoThread(context, ioEvent, pendingHandlers, [this]() {
+					if(socket && !sendFailed)
+						SSL_set_shutdown(socket->native_handle(),
+								SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+				});
+		}
 		SocketBase::Close();
 	}
 	
 	bool Socket::Connect(const Endpoint& endpoint, const char* certificateFile) {
+		return Connect(endpoint, *ClientContext::Shared(certificateFile));
+	}
+	
+	bool Socket::Connect(const Endpoint& endpoint,
+			ClientContext& clientContext) {
 		Close();
-		boost::asio::ssl::context sslContext(boost::asio::ssl::context::sslv23);
-		sslContext.load_verify_file(certificateFile);
-		socket = new ProtocolSocket(IoContext(), sslContext);
+		if(!clientContext.Valid())
+			return false;
+		socket = new ProtocolSocket(AssignIoContext(),
+				clientContext.GetContext());
+		sessionKey = endpoint.ToString();
+		clientContext.ResumeSession(socket->native_handle(), &sessionKey);
 		boost::system::error_code err;
 		socket->lowest_layer().connect(endpoint.TcpEndpoint(), err);
 		if(err) {
-			fprintf(stderr, "\n Failed to connect: %s", err.message());
+			fprintf(stderr, "\n Failed to connect: %s", err.message().c_str());
 			fflush(stderr);
-			delete socket;
-			socket = NULL;
+			Close();
 			return false;
 		}
-		socket->handshake(boost::asio::ssl::stream_base::client, err);
-		if(err) {
-			fprintf(stderr, "\n Failed to handshake: %s", err.message());
-			fflush(stderr);
-			delete socket;
-			socket = NULL;
+		if(!Handshake(false, defaultHandshakeTimeoutms)) {
+			Close();
 			return false;
 		}
 		FinalizeConnecting();
 		return true;
 	}
 	
+	bool Socket::SessionReused() {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		return Valid() && SSL_session_reused(socket->native_handle());
+	}
+	
 	void Socket::CreateEmptySocket(boost::asio::ssl::context* sslContext) {
 		Close();
-		socket = new ProtocolSocket(IoContext(), *sslContext);
+		socket = new ProtocolSocket(AssignIoContext(), *sslContext);
 	}
 	
 	bool Socket::StartServerSide() {
-		if(Valid()) {
-			boost::system::error_code err;
-			socket->handshake(boost::asio::ssl::stream_base::server, err);
-			if(err) {
-				Close();
-				printf("\n Failed to make handshake: %s", err.message());
-				return false;
-			}
+		if(Handshake(true, defaultHandshakeTimeoutms))
 			return true;
-		}
+		Close();
 		return false;
 	}
 	
+	bool Socket::Handshake(bool server, int timeoutms) {
+		bool finished = false;
+		bool success = false;
+		AsyncHandshake(server, timeoutms, [&](bool result) {
+				std::lock_guard<std::mutex> lock(ioEvent.mutex);
+				finished = true;
+				success = result;
+				ioEvent.Notify();
+			});
+		// the handshake timer closes the socket, so this always finishes
+		IoContextWaitFor(context, ioEvent, [&]()->bool {
+				return finished;
+			}, timeoutms+asio::closeFlushTimeoutms);
+		if(!finished) {
+			Interrupt();
+			IoContextWaitFor(context, ioEvent, [&]()->bool {
+					return finished;
+				}, asio::closeFlushTimeoutms);
+		}
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		return success;
+	}
+	
+	struct HandshakeTimer {
+		HandshakeTimer(boost::asio::io_context& context) :
+			timer(context), finished(false) {
+		}
+		
+		boost::asio::steady_timer timer;
+		bool finished;
+	};
+	
+	void Socket::AsyncHandshake(bool server, int timeoutms,
+			std::function<void(bool success)> done) {
+		{
+			std::lock_guard<std::mutex> lock(ioEvent.mutex);
+			if(Valid()) {
+				RunOnIoThread(context, ioEvent, pendingHandlers,
+						[this, server, timeoutms, done]() {
+							StartHandshake(server, timeoutms, done);
+						});
+				return;
+			}
+		}
+		done(false);
+	}
+	
+	void Socket::StartHandshake(bool server, int timeoutms,
+			std::function<void(bool success)> done) {
+		// timer and handshake handlers both run on the io thread, the timer
+		// touches the stream only while the handshake is still in progress
+		auto timer = std::make_shared<HandshakeTimer>(*context);
+		timer->timer.expires_after(std::chrono::milliseconds(timeoutms));
+		ProtocolSocket* stream = socket;
+		timer->timer.async_wait([timer, stream](
+					const boost::system::error_code& err) {
+				if(!err && !timer->finished) {
+					boost::system::error_code ignored;
+					stream->lowest_layer().close(ignored);
+				}
+			});
+		++pendingHandlers;
+		socket->async_handshake(server ?
+				boost::asio::ssl::stream_base::server :
+				boost::asio::ssl::stream_base::client,
+				std::bind(&Socket::HandshakeCompleted, this, timer, done,
+					std::placeholders::_1));
+	}
+	
+	void Socket::HandshakeCompleted(std::shared_ptr<HandshakeTimer> timer,
+			std::function<void(bool success)> done,
+			const boost::system::error_code& err) {
+		{
+			std::lock_guard<std::mutex> lock(ioEvent.mutex);
+			--pendingHandlers;
+			timer->finished = true;
+			timer->timer.cancel();
+			if(err && err != boost::asio::error::operation_aborted)
+				fprintf(stderr, "\n Failed to handshake: %s",
+						err.message().c_str());
+			ioEvent.Notify();
+		}
+		done(!err);
+	}
+	
 	
 	
 	Server::Server() {
 		sslContext = NULL;
+		handshakeTimeoutms = defaultHandshakeTimeoutms;
+		SetMaxPendingAccepts(defaultMaxPendingHandshakes);
 	}
 	
 	Server::~Server() {
 	}
 	
 	
+	void Server::SetSharding(uint32_t shards, uint32_t acceptsPerShard) {
+		ServerBase::SetSharding(shards, acceptsPerShard);
+	}
+	
+	void Server::SetHandshakeLimits(int timeoutms, uint32_t maxPending) {
+		{
+			std::lock_guard<std::mutex> lock(ioEvent.mutex);
+			handshakeTimeoutms = timeoutms;
+		}
+		SetMaxPendingAccepts(maxPending);
+	}
+	
 	void Server::Open(const Endpoint& endpoint, const char* certChainFile,
 				const char* privateKeyFile, const char* dhFile) {
 		ServerBase::Open(endpoint);
@@ -138,6 +424,15 @@ namespace ssl {
 		sslContext->use_private_key_file(privateKeyFile,
 				boost::asio::ssl::context::pem);
 		sslContext->use_tmp_dh_file(dhFile);
+		
+		SSL_CTX* ctx = sslContext->native_handle();
+		static const unsigned char sessionIdContext[] = "ICon3";
+		SSL_CTX_set_session_id_context(ctx, sessionIdContext,
+				sizeof(sessionIdContext)-1);
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+		SSL_CTX_sess_set_cache_size(ctx, serverSessionCacheSize);
+		// session tickets, with keys generated per server context
+		SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
 	}
 	
 	void Server::Close() {
@@ -184,13 +479,19 @@ namespace ssl {
 		return NULL;
 	}
 	
-	bool Server::Accept(Socket* socket) {
-		if(socket) {
-			socket->StartServerSide();
-			socket->FinalizeConnecting();
-			return true;
+	void Server::Accept(Socket* socket) {
+		// accepts run unlocked, while SetHandshakeLimits may be called
+		int timeoutms;
+		{
+			std::lock_guard<std::mutex> lock(ioEvent.mutex);
+			timeoutms = handshakeTimeoutms;
 		}
-		return false;
+		socket->AsyncHandshake(true, timeoutms,
+				[this, socket](bool success) {
+					if(success)
+						success = socket->FinalizeConnecting();
+					FinishAccept(socket, success);
+				});
 	}
 };
 
@@ -21,15 +21,84 @@
 
 #include <string>
 #include <vector>
+#include <list>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <mutex>
 
 #include "ASIO.hpp"
 #include "Socket.hpp"
 
+struct ssl_st;
+struct ssl_session_st;
+
 namespace ssl {
 	
 	using ProtocolSocket = boost::asio::ssl::stream<boost::asio::ip::tcp::socket>;
 	using SocketBase = asio::Socket<ProtocolSocket>;
 	
+	/*
+	 *  Handshakes are asynchronous. A connection whose handshake does not
+	 *  finish within the timeout is closed. A server publishes an accepted
+	 *  socket only after its handshake succeeded and stops accepting while
+	 *  maxPending handshakes are in progress.
+	 */
+	const int defaultHandshakeTimeoutms = 10000;
+	const uint32_t defaultMaxPendingHandshakes = 1024;
+	
+	struct HandshakeTimer;
+	
+	/*
+	 *  Client side TLS context shared by many connections: the CA file is
+	 *  parsed once, and the last session (TLS 1.3 ticket or TLS 1.2 session
+	 *  id) received from every endpoint is cached, so reconnects resume
+	 *  instead of doing a full handshake. Above maxSessions the endpoint
+	 *  whose session was stored longest ago is dropped. Shared returns a
+	 *  process wide context for a CA file; it is what Connect(endpoint,
+	 *  certificateFile) uses.
+	 */
+	class ClientContext {
+	public:
+		
+		const static uint32_t defaultMaxCachedSessions = 4096;
+		
+		ClientContext();
+		ClientContext(const char* certificateFile);
+		~ClientContext();
+		ClientContext(const ClientContext&) = delete;
+		ClientContext& operator =(const ClientContext&) = delete;
+		
+		static ClientContext* Shared(const char* certificateFile);
+		
+		bool LoadVerifyFile(const char* certificateFile);
+		bool Valid() const;
+		boost::asio::ssl::context& GetContext();
+		
+		void SetMaxCachedSessions(uint32_t maxSessions);
+		void ClearSessions();
+		
+		void ResumeSession(ssl_st* ssl, const std::string* key);
+		
+	private:
+		
+		static int NewSession(ssl_st* ssl, ssl_session_st* session);
+		void StoreSession(const std::string& key, ssl_session_st* session);
+		
+		struct CachedSession {
+			ssl_session_st* session;
+			std::list<std::string>::iterator stored;
+		};
+		
+		boost::asio::ssl::context* sslContext;
+		std::mutex mutex;
+		std::unordered_map<std::string, CachedSession> sessions;
+		// keys in the order their sessions were stored, oldest first
+		std::list<std::string> storeOrder;
+		uint32_t maxSessions;
+		bool valid;
+	};
+	
 	class Socket : public asio::Socket<ProtocolSocket> {
 	public:
 		
@@ -37,29 +106,66 @@ namespace ssl {
 		virtual ~Socket() override;
 		
 		bool Send(const std::vector<uint8_t>& buffer);
+		bool Send(std::vector<uint8_t>&& buffer);
 		bool Send(const Message& msg);
+		bool Send(Message&& msg);
+		bool Send(const FastMessage& msg);
+		bool Flush(int timeoutms=-1);
+		uint64_t GetQueuedSendBytes() const;
+		bool HasSendFailed() const;
+		void SetSendCallback(
+				std::function<void(bool success, uint64_t bytes)> callback);
 		bool TryPopMessage(Message& message, int timeoutms=-1);
+		bool TryPopMessage(FastMessage& message, int timeoutms=-1);
+		bool TryPeekMessage(MessageView& view, int timeoutms=-1);
+		void ConsumeMessage();
+		void ReleaseMessage();
+		void SetReceiveBufferCapacity(uint64_t bytes);
 		void GetMessageCompletition(uint64_t&recvd, uint64_t& required);
 		ProtocolSocket* GetSocket();
 		bool HasMessage() const;
 		virtual void Close() override;
 		
 		bool Connect(const Endpoint& endpoint, const char* certificateFile);
+		bool Connect(const Endpoint& endpoint, ClientContext& clientContext);
+		bool SessionReused();
 		
 		void CreateEmptySocket(boost::asio::ssl::context* sslContext);
 		bool StartServerSide();
+		
+		// done is called once, from an io handler, without any lock held
+		void AsyncHandshake(bool server, int timeoutms,
+				std::function<void(bool success)> done);
+		
+	private:
+		
+		bool Handshake(bool server, int timeoutms);
+		void StartHandshake(bool server, int timeoutms,
+				std::function<void(bool success)> done);
+#ifdef CPP_FILES_CPP
+		void HandshakeCompleted(std::shared_ptr<HandshakeTimer> timer,
+				std::function<void(bool success)> done,
+				const boost::system::error_code& err);
+#endif
+		
+		std::string sessionKey;
 	};
 	
 	
 	
 	using ServerBase = asio::Server<Socket>;
 	
+	// sessions kept by a server for resumption by session id
+	const long serverSessionCacheSize = 20*1024;
+	
 	class Server : public asio::Server<Socket> {
-	public:h
+	public:
 		
 		Server();
 		virtual ~Server() override;
 		
+		void SetSharding(uint32_t shards, uint32_t acceptsPerShard=4);
+		void SetHandshakeLimits(int timeoutms, uint32_t maxPending);
 		void Open(const Endpoint& endpoint, const char* certChainFile,
 				const char* privateKeyFile, const char* dhFile);
 		virtual void Close() override;
@@ -73,12 +179,13 @@ namespace ssl {
 		virtual bool Valid() const override;
 		
 		virtual Socket* CreateEmptyAcceptingSocket() override;
-		virtual bool Accept(Socket* socket) override;
+		virtual void Accept(Socket* socket) override;
 		
 	private:
 		
 		boost::asio::ssl::context* sslContext;
-		
+		int handshakeTimeoutms;
+	
 	};
 };
 
@@ -26,13 +26,39 @@
 #include "Socket.hpp"
 
 #include <thread>
+#include <mutex>
+
+#include <cstring>
 
 namespace asio{
 	
+	// lets async_write use inFlightBuffers in place, a vector would be copied
+	struct ConstBufferRange {
+		const boost::asio::const_buffer* begin() const {
+			return first;
+		}
+		const boost::asio::const_buffer* end() const {
+			return last;
+		}
+		
+		const boost::asio::const_buffer* first;
+		const boost::asio::const_buffer* last;
+	};
+	
 	template<typename T>
 	Socket<T>::Socket() {
 		socket = NULL;
-		fetchRequestSize = 0;
+		context = NULL;
+		pendingHandlers = 0;
+		queuedSendBytes = 0;
+		inFlightBytes = 0;
+		writeInProgress = false;
+		writeScheduled = false;
+		sendFailed = false;
+		receiveFailed = false;
+		parsedBytes = 0;
+		missingBytes = 0;
+		fetchPostponed = false;
 	}
 	
 	template<typename T>
@@ -43,16 +69,63 @@ namespace asio{
 	
 	template<typename T>
 	void Socket<T>::Close() {
+		bool flush;
+		{
+			std::lock_guard<std::mutex> lock(ioEvent.mutex);
+			flush = CanSend() && socket->lowest_layer().is_open();
+		}
+		if(flush)
+			Flush(closeFlushTimeoutms);
+		Interrupt();
+		WaitForPendingHandlers(context, ioEvent, pendingHandlers);
+		
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
 		endpoint = Endpoint();
 		if(socket) {
 			delete socket;
 			socket = NULL;
 		}
-		buffer.clear();
-		buffer.shrink_to_fit();
-		fetchRequestSize = 0;
-		while(!receivedMessages.empty())
-			receivedMessages.pop();
+		if(context) {
+			ReleaseIoContext(context);
+			context = NULL;
+		}
+		pendingEntries.clear();
+		pendingStaging.clear();
+		inFlightEntries.clear();
+		inFlightStaging.clear();
+		inFlightBuffers.clear();
+		queuedSendBytes = 0;
+		inFlightBytes = 0;
+		writeInProgress = false;
+		writeScheduled = false;
+		sendFailed = false;
+		receiveFailed = false;
+		receiveBuffer.Release();
+		frameParser.Reset();
+		parsedBytes = 0;
+		missingBytes = 0;
+		fetchPostponed = false;
+		while(!receivedFrames.empty())
+			receivedFrames.pop();
+	}
+	
+	
+	template<typename T>
+	void Socket<T>::Interrupt() {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		if(socket) {
+			RunOnIoThread(context, ioEvent, pendingHandlers, [this]() {
+					boost::system::error_code err;
+					socket->lowest_layer().close(err);
+				});
+		}
+	}
+	
+	template<typename T>
+	boost::asio::io_context& Socket<T>::AssignIoContext() {
+		if(context == NULL)
+			context = &AcquireIoContext();
+		return *context;
 	}
 	
 	
@@ -64,94 +137,362 @@ namespace asio{
 	
 	template<typename T>
 	bool Socket<T>::Send(const std::vector<uint8_t>& buffer) {
-		if(Valid()) {
-			boost::system::error_code err;
-			for(uint64_t i=0; i<buffer.size();) {
-				uint64_t toWrite = std::min<uint64_t>(
-						buffer.size()-i,
-						maxSinglePacketSize);
-				IoContextPollOne();
-				uint64_t written = socket->write_some(
-						boost::asio::buffer(
-							&(buffer[i]),
-							toWrite),
-						err);
-				
-				i += written;
-				if(err) {
-					fprintf(stderr, "\n fault send: %llu / %llu,  error: %s", i,
-							buffer.size(), err.message());
-					return false;
-				} else if(written == 0) {
-					fprintf(stderr, "\n fault send (0): %llu / %llu", i,
-							buffer.size());
-				}
-			}
-			return true;
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		if(!CanSend())
+			return false;
+		if(buffer.size() <= smallFrameSize) {
+			memcpy(AppendStaging(buffer.size()), buffer.data(), buffer.size());
+		} else {
+			OutboundEntry& entry = AppendLarge(true);
+			entry.message.data = buffer;
 		}
-		return false;
+		queuedSendBytes += buffer.size();
+		ScheduleWrite();
+		return true;
+	}
+	
+	template<typename T>
+	bool Socket<T>::Send(std::vector<uint8_t>&& buffer) {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		if(!CanSend())
+			return false;
+		const uint64_t size = buffer.size();
+		if(size <= smallFrameSize) {
+			memcpy(AppendStaging(buffer.size()), buffer.data(), buffer.size());
+		} else {
+			OutboundEntry& entry = AppendLarge(true);
+			entry.message.data.swap(buffer);
+		}
+		queuedSendBytes += size;
+		ScheduleWrite();
+		return true;
 	}
 	
 	template<typename T>
 	bool Socket<T>::Send(const Message& msg) {
-		if(Valid()) {
-			std::vector<uint8_t> buffer;
-			CreateOptimalBuffer(msg, buffer);
-			return Send(buffer);
+		return EnqueueMessage(msg, NULL);
+	}
+	
+	template<typename T>
+	bool Socket<T>::Send(Message&& msg) {
+		return EnqueueMessage(msg, &msg);
+	}
+	
+	template<typename T>
+	bool Socket<T>::Send(const FastMessage& msg) {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		if(!CanSend())
+			return false;
+		memcpy(AppendStaging(msg.wholeMessageLength), msg.buffer,
+				msg.wholeMessageLength);
+		queuedSendBytes += msg.wholeMessageLength;
+		ScheduleWrite();
+		return true;
+	}
+	
+	template<typename T>
+	bool Socket<T>::Flush(int timeoutms) {
+		bool flushed = false;
+		IoContextWaitFor(context, ioEvent, [&]()->bool {
+				flushed = queuedSendBytes == 0;
+				return flushed || !Valid() || sendFailed;
+			}, timeoutms);
+		return flushed;
+	}
+	
+	template<typename T>
+	uint64_t Socket<T>::GetQueuedSendBytes() const {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		return queuedSendBytes;
+	}
+	
+	template<typename T>
+	bool Socket<T>::HasSendFailed() const {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		return sendFailed;
+	}
+	
+	template<typename T>
+	void Socket<T>::SetSendCallback(
+			std::function<void(bool success, uint64_t bytes)> callback) {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		sendCallback = callback;
+	}
+	
+	
+	template<typename T>
+	bool Socket<T>::CanSend() const {
+		return Valid() && !sendFailed;
+	}
+	
+	template<typename T>
+	bool Socket<T>::EnqueueMessage(const Message& msg, Message* owned) {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		if(!CanSend())
+			return false;
+		NumberBuffer header;
+		std::array<boost::asio::const_buffer, 3> buffers;
+		uint64_t size = CreateFrameBuffers(msg, header, buffers);
+		if(size <= smallFrameSize) {
+			boost::asio::buffer_copy(
+					boost::asio::buffer(AppendStaging(size), size), buffers);
+		} else {
+			OutboundEntry& entry = AppendLarge(false);
+			if(owned)
+				entry.message.Swap(*owned);
+			else
+				entry.message = msg;
 		}
-		return false;
+		queuedSendBytes += size;
+		ScheduleWrite();
+		return true;
+	}
+	
+	template<typename T>
+	uint8_t* Socket<T>::AppendStaging(uint64_t bytes) {
+		uint64_t offset = pendingStaging.size();
+		pendingStaging.resize(offset+bytes);
+		if(pendingEntries.empty() || pendingEntries.back().large) {
+			pendingEntries.emplace_back();
+			pendingEntries.back().large = false;
+			pendingEntries.back().raw = true;
+			pendingEntries.back().stagingBegin = offset;
+		}
+		pendingEntries.back().stagingEnd = offset+bytes;
+		return pendingStaging.data()+offset;
+	}
+	
+	template<typename T>
+	typename Socket<T>::OutboundEntry& Socket<T>::AppendLarge(bool raw) {
+		pendingEntries.emplace_back();
+		OutboundEntry& entry = pendingEntries.back();
+		entry.large = true;
+		entry.raw = raw;
+		entry.stagingBegin = entry.stagingEnd = 0;
+		return entry;
+	}
+	
+	template<typename T>
+	void Socket<T>::ScheduleWrite() {
+		if(writeInProgress || writeScheduled)
+			return;
+		writeScheduled = true;
+		// no write is in flight until StartWrite, so they share writeMemory
+		RunOnIoThread(context, ioEvent, pendingHandlers, [this]() {
+				StartWrite();
+			}, &writeMemory);
+	}
+	
+	template<typename T>
+	void Socket<T>::StartWrite() {
+		writeScheduled = false;
+		if(writeInProgress || pendingEntries.empty() || !Valid())
+			return;
+		inFlightEntries.swap(pendingEntries);
+		inFlightStaging.swap(pendingStaging);
+		inFlightBuffers.clear();
+		inFlightBytes = 0;
+		for(OutboundEntry& entry : inFlightEntries) {
+			if(!entry.large) {
+				inFlightBuffers.emplace_back(
+						inFlightStaging.data()+entry.stagingBegin,
+						entry.stagingEnd-entry.stagingBegin);
+			} else if(entry.raw) {
+				inFlightBuffers.emplace_back(
+						boost::asio::buffer(entry.message.data));
+			} else {
+				std::array<boost::asio::const_buffer, 3> buffers;
+				CreateFrameBuffers(entry.message, entry.header, buffers);
+				inFlightBuffers.insert(inFlightBuffers.end(),
+						buffers.begin(), buffers.end());
+			}
+		}
+		inFlightBytes = boost::asio::buffer_size(inFlightBuffers);
+		writeInProgress = true;
+		++pendingHandlers;
+		boost::asio::async_write(*socket, ConstBufferRange{
+					inFlightBuffers.data(),
+					inFlightBuffers.data()+inFlightBuffers.size()},
+				BindHandlerMemory(writeMemory,
+					std::bind(&Socket::WriteCompleted,
+						this,
+						std::placeholders::_1,
+						std::placeholders::_2)));
+	}
+	
+	template<typename T>
+	void Socket<T>::WriteCompleted(const boost::system::error_code& err,
+			size_t length) {
+		bool callback = false;
+		if(err != boost::asio::error::operation_aborted) {
+			std::lock_guard<std::mutex> lock(ioEvent.mutex);
+			writeInProgress = false;
+			queuedSendBytes -= inFlightBytes;
+			inFlightBytes = 0;
+			inFlightEntries.clear();
+			inFlightStaging.clear();
+			inFlightBuffers.clear();
+			if(err) {
+				fprintf(stderr, "\n fault send: %llu bytes,  error: %s",
+						(unsigned long long)length, err.message().c_str());
+				sendFailed = true;
+				pendingEntries.clear();
+				pendingStaging.clear();
+				queuedSendBytes = 0;
+			}
+			StartWrite();
+			callback = (bool)sendCallback;
+			ioEvent.Notify();
+		}
+		// called unlocked, so the callback may queue more data with Send
+		if(callback)
+			sendCallback(!err, length);
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		--pendingHandlers;
+		ioEvent.Notify();
+	}
+	
+	
+	template<typename T>
+	void Socket<T>::SetReceiveBufferCapacity(uint64_t bytes) {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		receiveBuffer.SetCapacity(bytes);
 	}
 	
 	
 	template<typename T>
 	bool Socket<T>::HasMessage() const {
-		return !receivedMessages.empty();
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		return !receivedFrames.empty();
 	}
 	
 	template<typename T>
 	void Socket<T>::GetMessageCompletition(uint64_t&recvd, uint64_t& required) {
-		if(HasMessage()) {
-			required = recvd = receivedMessages.front().title.size()+1
-				+ receivedMessages.front().data.size();
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		if(!receivedFrames.empty()) {
+			required = recvd = receivedFrames.front().frameSize
+				- receivedFrames.front().headerSize;
 		} else {
-			GetBufferMessageCompletition(recvd, required);
+			BufferMessageCompletition(recvd, required);
 		}
 	}
 	
 	template<typename T>
 	void Socket<T>::GetBufferMessageCompletition(uint64_t&recvd,
 			uint64_t& required) {
-		recvd = buffer.size()-fetchRequestSize;
-		required = 0;
-		NumberBuffer n;
-		uint64_t c = n.SetBytes(&buffer.front(), recvd);
-		if(c == 0) {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		BufferMessageCompletition(recvd, required);
+	}
+	
+	template<typename T>
+	void Socket<T>::BufferMessageCompletition(uint64_t&recvd,
+			uint64_t& required) {
+		// every received byte has already been fed to frameParser
+		if(frameParser.GetState() == FrameParser::awaitingHeader) {
 			recvd = 0;
 			required = 0;
 			return;
 		}
-		required = n.GetValue() + c;
-		if(recvd > required)
-			recvd = required;
+		recvd = frameParser.GetReceivedBytes();
+		required = frameParser.GetFrameSize();
 	}
 	
 	template<typename T>
 	bool Socket<T>::TryPopMessage(Message& message, int timeoutms) {
-		IoContextPollOne();
-		int end = clock() + timeoutms;
-		while(end>clock() && receivedMessages.empty() && Valid()) {
-			std::this_thread::yield();
-			IoContextPollOne();
-			std::this_thread::yield();
-		}
-		if(!receivedMessages.empty()) {
-			receivedMessages.front().Swap(message);
-			receivedMessages.pop();
-			return true;
+		if(WaitForMessage(timeoutms)) {
+			std::lock_guard<std::mutex> lock(ioEvent.mutex);
+			if(!receivedFrames.empty()) {
+				GetFrontView().CopyTo(message);
+				InternalConsumeMessage();
+				return true;
+			}
+		}
+		return false;
+	}
+	
+	template<typename T>
+	bool Socket<T>::TryPopMessage(FastMessage& message, int timeoutms) {
+		if(WaitForMessage(timeoutms)) {
+			std::lock_guard<std::mutex> lock(ioEvent.mutex);
+			if(!receivedFrames.empty() && receivedFrames.front().frameSize <=
+					FastMessage::maxFastMessageSize) {
+				if(!message.Decode(receiveBuffer.Data(),
+							receivedFrames.front().frameSize))
+					return false;
+				InternalConsumeMessage();
+				return true;
+			}
+		}
+		return false;
+	}
+	
+	template<typename T>
+	bool Socket<T>::TryPeekMessage(MessageView& view, int timeoutms) {
+		if(WaitForMessage(timeoutms)) {
+			std::lock_guard<std::mutex> lock(ioEvent.mutex);
+			if(!receivedFrames.empty()) {
+				view = GetFrontView();
+				receiveBuffer.Pin();
+				return true;
+			}
 		}
 		return false;
 	}
 	
+	template<typename T>
+	void Socket<T>::ConsumeMessage() {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		InternalConsumeMessage();
+	}
+	
+	template<typename T>
+	void Socket<T>::ReleaseMessage() {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		InternalReleaseMessage();
+	}
+	
+	template<typename T>
+	void Socket<T>::InternalConsumeMessage() {
+		if(!receivedFrames.empty()) {
+			uint64_t frameSize = receivedFrames.front().frameSize;
+			receivedFrames.pop();
+			parsedBytes -= frameSize;
+			receiveBuffer.Consume(frameSize);
+		}
+		InternalReleaseMessage();
+	}
+	
+	template<typename T>
+	void Socket<T>::InternalReleaseMessage() {
+		if(receiveBuffer.IsPinned()) {
+			receiveBuffer.Unpin();
+			if(fetchPostponed) {
+				fetchPostponed = false;
+				RunOnIoThread(context, ioEvent, pendingHandlers, [this]() {
+						RequestDataFetch(missingBytes);
+					});
+			}
+		}
+	}
+	
+	template<typename T>
+	bool Socket<T>::WaitForMessage(int timeoutms) {
+		return IoContextWaitFor(context, ioEvent, [this]()->bool {
+				return !receivedFrames.empty() || !Valid();
+			}, timeoutms);
+	}
+	
+	template<typename T>
+	MessageView Socket<T>::GetFrontView() const {
+		const ReceivedFrame& frame = receivedFrames.front();
+		const uint8_t* body = receiveBuffer.Data() + frame.headerSize;
+		MessageView view;
+		view.title = std::string_view((const char*)body, frame.titleSize);
+		view.data.data = receiveBuffer.Data() + frame.dataOffset;
+		view.data.size = frame.frameSize - frame.dataOffset;
+		return view;
+	}
+	
 	
 	template<typename T>
 	T* Socket<T>::GetSocket() {
@@ -161,15 +502,18 @@ namespace asio{
 	
 	template<typename T>
 	bool Socket<T>::Valid() const {
-		return socket!=NULL;
+		return socket!=NULL && !receiveFailed;
 	}
 	
 	
 	template<typename T>
 	bool Socket<T>::FinalizeConnecting() {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
 		if(Valid()) {
 			this->endpoint = Endpoint(socket->lowest_layer().remote_endpoint());
-			RequestDataFetch(1);
+			RunOnIoThread(context, ioEvent, pendingHandlers, [this]() {
+					RequestDataFetch(minimumReadSize);
+				});
 			return true;
 		}
 		return false;
@@ -179,55 +523,105 @@ namespace asio{
 	template<typename T>
 	void Socket<T>::FetchData(const boost::system::error_code& err,
 			size_t length) {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		--pendingHandlers;
 		if(err) {
-			fprintf(stderr, "\n Error occured while fetching data: %s", err.message());
+			if(err != boost::asio::error::operation_aborted)
+				fprintf(stderr, "\n Error occured while fetching data: %s",
+						err.message().c_str());
 		} else if(Valid()) {
-			if(fetchRequestSize != length)
-				buffer.resize(buffer.size()-(fetchRequestSize-length));
-			fetchRequestSize = 0;
-			if(!err) {
-				uint64_t recvd=0, required=0;
-				GetBufferMessageCompletition(recvd, required);
-				if(required>0 && recvd>=required) {
-					Message message;
-					uint64_t readed = TryReadMessageFromBuffer(message, buffer);
-					if(readed > 0) {
-						receivedMessages.emplace();
-						receivedMessages.back().Swap(message);
-						buffer.erase(buffer.begin(), buffer.begin()+readed);
-						if(buffer.capacity() > 64*1024)
-							buffer.shrink_to_fit();
-					} else {
-						DEBUG("Failed to read message from buffer, when whole available");
-					}
-				} else if(required>0 && recvd<required) {
-					RequestDataFetch(required-recvd);
-					return;
-				}
+			receiveBuffer.CommitWrite(length);
+			missingBytes = ParseReceivedFrames();
+			if(frameParser.GetState() == FrameParser::invalid) {
+				// the stream cannot be resynchronized, frames parsed before
+				// the malformed header can still be popped
+				fprintf(stderr, "\n Received frame header is malformed,"
+						" closing the socket");
+				receiveFailed = true;
+				boost::system::error_code ignored;
+				socket->lowest_layer().close(ignored);
+			} else {
+				RequestDataFetch(missingBytes);
 			}
-			RequestDataFetch(1);
 		} else {
 			DEBUG("Socket is invalid while reading fetching data!");
 		}
+		ioEvent.Notify();
+	}
+	
+	template<typename T>
+	uint64_t Socket<T>::ParseReceivedFrames() {
+		// parsedBytes counts every byte scanned or fed to frameParser, including
+		// the ones of the incomplete frame at the end
+		const uint8_t* data = receiveBuffer.Data();
+		const uint64_t size = receiveBuffer.Size();
+		while(parsedBytes < size) {
+			if(frameParser.GetReceivedBytes() == 0) {
+				// between frames, take every complete one in a single scan
+				// and leave only the incomplete or malformed rest to
+				// frameParser
+				varint::Frame frames[64];
+				uint64_t missing;
+				const uint8_t* begin = data+parsedBytes;
+				const size_t count = varint::ScanFrames(begin,
+						size-parsedBytes, frames, 64, missing);
+				for(size_t i=0; i<count; ++i) {
+					const varint::Frame& frame = frames[i];
+					ReceivedFrame received;
+					received.frameSize = frame.headerSize + frame.bodySize;
+					received.titleSize = FrameParser::TitleSize(
+							begin+frame.offset+frame.headerSize,
+							frame.bodySize);
+					received.dataOffset = FrameParser::DataOffset(
+							frame.headerSize, frame.bodySize,
+							received.titleSize);
+					received.headerSize = frame.headerSize;
+					receivedFrames.emplace(received);
+				}
+				if(count) {
+					const varint::Frame& last = frames[count-1];
+					parsedBytes += last.offset + last.headerSize +
+						last.bodySize;
+					if(count == 64 || parsedBytes == size)
+						continue;
+				}
+			}
+			parsedBytes += frameParser.Feed(data+parsedBytes, size-parsedBytes);
+			if(frameParser.GetState() != FrameParser::complete)
+				break;
+			ReceivedFrame received;
+			received.frameSize = frameParser.GetFrameSize();
+			received.titleSize = frameParser.GetTitleSize();
+			received.dataOffset = frameParser.GetDataOffset();
+			received.headerSize = frameParser.GetHeaderSize();
+			receivedFrames.emplace(received);
+			frameParser.Reset();
+		}
+		return frameParser.GetMissingBytes();
 	}
 	
 	template<typename T>
 	void Socket<T>::RequestDataFetch(uint64_t bytes) {
 		if(Valid()) {
-			if(bytes > maxSinglePacketSize) {
-				bytes = maxSinglePacketSize;
+			if(bytes > maxBulkReadSize) {
+				bytes = maxBulkReadSize;
 			}
-			if(bytes == 0)
-				bytes = 1;
-			uint64_t currentSize = buffer.size();
-			buffer.resize(currentSize+bytes);
-			fetchRequestSize = bytes;
-			socket->async_read_some(boost::asio::buffer(
-					&(buffer[currentSize]), bytes),
-					std::bind(&Socket::FetchData,
-						this,
-						std::placeholders::_1,
-						std::placeholders::_2));
+			if(bytes < minimumReadSize)
+				bytes = minimumReadSize;
+			uint8_t* free = receiveBuffer.PrepareWrite(bytes);
+			bytes = std::min(receiveBuffer.GetWriteSpace(), maxBulkReadSize);
+			if(bytes == 0) {
+				// ring is pinned by a MessageView, continue after release
+				fetchPostponed = true;
+				return;
+			}
+			++pendingHandlers;
+			socket->async_read_some(boost::asio::buffer(free, bytes),
+					BindHandlerMemory(readMemory,
+						std::bind(&Socket::FetchData,
+							this,
+							std::placeholders::_1,
+							std::placeholders::_2)));
 		} else {
 			DEBUG("\n Socket is invalid while requesting data fetch!");
 		}
@@ -239,8 +633,11 @@ namespace asio{
 	
 	template<typename T>
 	Server<T>::Server() {
-		acceptor = NULL;
-		currentAcceptingSocket = NULL;
+		context = NULL;
+		pendingHandlers = 0;
+		shardsCount = 1;
+		acceptsPerShard = 1;
+		maxPendingAccepts = 0;
 	}
 	
 	template<typename T>
@@ -249,48 +646,126 @@ namespace asio{
 	}
 	
 	
+	template<typename T>
+	void Server<T>::SetSharding(uint32_t shards, uint32_t accepts) {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		shardsCount = shards;
+		acceptsPerShard = accepts ? accepts : 1;
+	}
+	
+	template<typename T>
+	void Server<T>::SetMaxPendingAccepts(uint32_t maxPending) {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		maxPendingAccepts = maxPending;
+	}
+	
 	template<typename T>
 	void Server<T>::Open(const Endpoint& endpoint) {
 		Close();
-		acceptor = new boost::asio::ip::tcp::acceptor(
-				IoContext(),
-				endpoint.TcpEndpoint());
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		uint32_t count = shardsCount;
+		if(count == 0)
+			count = std::max<uint32_t>(1, GetIoThreadsCount());
+		uint32_t accepts = acceptsPerShard;
+#ifndef SO_REUSEPORT
+		// no port sharing, keep all accepts outstanding on one acceptor
+		accepts *= count;
+		count = 1;
+#endif
+		boost::asio::ip::tcp::endpoint tcpEndpoint = endpoint.TcpEndpoint();
+		boost::system::error_code err;
+		for(uint32_t i=0; i<count; ++i) {
+			AcceptorShard shard;
+			shard.context = &AcquireIoContext();
+			shard.acceptor = new boost::asio::ip::tcp::acceptor(*shard.context);
+			shard.accepting.resize(accepts, NULL);
+			
+			shard.acceptor->open(tcpEndpoint.protocol(), err);
+			if(!err)
+				shard.acceptor->set_option(
+						boost::asio::socket_base::reuse_address(true), err);
+#ifdef SO_REUSEPORT
+			if(!err && count > 1)
+				shard.acceptor->set_option(
+						boost::asio::detail::socket_option::boolean<
+							SOL_SOCKET, SO_REUSEPORT>(true), err);
+#endif
+			if(!err)
+				shard.acceptor->bind(tcpEndpoint, err);
+			if(!err)
+				shard.acceptor->listen(
+						boost::asio::socket_base::max_listen_connections, err);
+			if(err) {
+				fprintf(stderr, "\n Failed to open acceptor shard %u: %s",
+						i, err.message().c_str());
+				delete shard.acceptor;
+				ReleaseIoContext(shard.context);
+				continue;
+			}
+			// with port 0 the remaining shards share the port picked for
+			// the first one
+			if(shards.empty() && tcpEndpoint.port() == 0)
+				tcpEndpoint = shard.acceptor->local_endpoint(err);
+			shards.emplace_back(shard);
+		}
+		if(shards.empty())
+			throw boost::system::system_error(err);
+		context = shards.front().context;
 	}
 	
 	template<typename T>
 	void Server<T>::Close() {
-		if(acceptor) {
-			acceptor->close();
-			delete acceptor;
-			acceptor = NULL;
+		{
+			std::lock_guard<std::mutex> lock(ioEvent.mutex);
+			for(AcceptorShard& shard : shards) {
+				boost::asio::ip::tcp::acceptor* acceptor = shard.acceptor;
+				RunOnIoThread(shard.context, ioEvent, pendingHandlers,
+						[acceptor]() {
+							boost::system::error_code err;
+							acceptor->close(err);
+						});
+			}
+			for(T* socket : pendingAccepts)
+				socket->Interrupt();
 		}
+		WaitForPendingHandlers(context, ioEvent, pendingHandlers);
+		
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		for(AcceptorShard& shard : shards) {
+			delete shard.acceptor;
+			ReleaseIoContext(shard.context);
+		}
+		shards.clear();
+		pausedSlots.clear();
+		context = NULL;
 	}
 	
 	
 	template<typename T>
 	bool Server<T>::IsListening() {
-		return Valid() && currentAcceptingSocket!=NULL;
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		if(Valid())
+			for(const AcceptorShard& shard : shards)
+				for(T* socket : shard.accepting)
+					if(socket)
+						return true;
+		return false;
 	}
 	
 	template<typename T>
 	bool Server<T>::HasNewSocket() const {
-		if(Valid()) {
-			if(newSockets.empty())
-				IoContextPollOne();
-			return !newSockets.empty();
-		}
-		return false;
+		bool valid = Valid();
+		return IoContextWaitFor(context, ioEvent, [&]()->bool {
+				return valid && !newSockets.empty();
+			}, 0);
 	}
 	
 	template<typename T>
 	T* Server<T>::TryGetNewSocket(int timeoutms) {
-		IoContextPollOne();
-		int end = clock() + timeoutms;
-		while(end>clock() && newSockets.empty() && Valid()) {
-			std::this_thread::yield();
-			IoContextPollOne();
-			std::this_thread::yield();
-		}
+		IoContextWaitFor(context, ioEvent, [this]()->bool {
+				return !newSockets.empty() || !Valid();
+			}, timeoutms);
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
 		if(!newSockets.empty()) {
 			T* ret = newSockets.front();
 			newSockets.pop();
@@ -311,45 +786,102 @@ namespace asio{
 	
 	template<typename T>
 	void Server<T>::StartListening() {
-		if(!IsListening()) {
-			currentAcceptingSocket = CreateEmptyAcceptingSocket();
-			acceptor->async_accept(
-					currentAcceptingSocket->GetSocket()->lowest_layer(),
-					std::bind(&Server<T>::DoAccept, this,
-						std::placeholders::_1));
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		for(uint32_t i=0; i<shards.size(); ++i) {
+			RunOnIoThread(shards[i].context, ioEvent, pendingHandlers,
+					[this, i]() {
+						for(uint32_t j=0; j<shards[i].accepting.size(); ++j)
+							AsyncAccept(i, j);
+					});
 		}
 	}
 	
+	template<typename T>
+	void Server<T>::AsyncAccept(uint32_t shardId, uint32_t slot) {
+		if(!Valid())
+			return;
+		AcceptorShard& shard = shards[shardId];
+		if(!shard.acceptor->is_open() || shard.accepting[slot])
+			return;
+		if(maxPendingAccepts && pendingAccepts.size() >= maxPendingAccepts) {
+			pausedSlots.emplace_back(shardId, slot);
+			return;
+		}
+		T* socket = CreateEmptyAcceptingSocket();
+		if(socket == NULL)
+			return;
+		shard.accepting[slot] = socket;
+		++pendingHandlers;
+		shard.acceptor->async_accept(
+				socket->GetSocket()->lowest_layer(),
+				std::bind(&Server<T>::DoAccept, this, shardId, slot,
+					std::placeholders::_1));
+	}
+	
 	
 	template<typename T>
 	bool Server<T>::Valid() const {
-		return acceptor!=NULL;
+		return !shards.empty();
 	}
 	
 	
 	template<typename T>
-	void Server<T>::DoAccept(const boost::system::error_code& err) {
+	void Server<T>::DoAccept(uint32_t shardId, uint32_t slot,
+			const boost::system::error_code& err) {
+		T* socket;
+		{
+			std::lock_guard<std::mutex> lock(ioEvent.mutex);
+			socket = shards[shardId].accepting[slot];
+			shards[shardId].accepting[slot] = NULL;
+			if(!err) {
+				pendingAccepts.insert(socket);
+				++pendingHandlers;
+			}
+		}
+		// Accept runs unlocked, so shards do not wait for each other
 		if(err) {
-			fprintf(stderr, "\n Error while accepting new socket");
-			delete currentAcceptingSocket;
-			currentAcceptingSocket = NULL;
+			if(err != boost::asio::error::operation_aborted)
+				fprintf(stderr, "\n Error while accepting new socket");
+			delete socket;
 		} else {
-			if(Accept(currentAcceptingSocket)) {
-				newSockets.emplace(currentAcceptingSocket);
-				currentAcceptingSocket = NULL;
-			} else {
-				delete currentAcceptingSocket;
-				currentAcceptingSocket = NULL;
-			}
-			StartListening();
+			Accept(socket);
 		}
+		
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		--pendingHandlers;
+		if(!err)
+			AsyncAccept(shardId, slot);
+		ioEvent.Notify();
 	}
 	
 	template<typename T>
-	bool Server<T>::Accept(T* socket) {
-		return socket!=NULL;
+	void Server<T>::FinishAccept(T* socket, bool accepted) {
+		{
+			std::lock_guard<std::mutex> lock(ioEvent.mutex);
+			pendingAccepts.erase(socket);
+			if(accepted)
+				newSockets.emplace(socket);
+			while(!pausedSlots.empty() && (maxPendingAccepts == 0 ||
+						pendingAccepts.size() < maxPendingAccepts)) {
+				std::pair<uint32_t, uint32_t> paused = pausedSlots.back();
+				pausedSlots.pop_back();
+				RunOnIoThread(shards[paused.first].context, ioEvent,
+						pendingHandlers, [this, paused]() {
+							AsyncAccept(paused.first, paused.second);
+						});
+			}
+			--pendingHandlers;
+			ioEvent.Notify();
+		}
+		if(!accepted)
+			delete socket;
 	}
 	
+	template<typename T>
+	void Server<T>::Accept(T* socket) {
+		FinishAccept(socket, socket->FinalizeConnecting());
+	}
+
 };
 
 #endif
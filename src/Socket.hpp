@@ -20,14 +20,46 @@
 #define SOCKET_HPP
 
 #include "ASIO.hpp"
+#include "RingBuffer.hpp"
+#include "FrameParser.hpp"
 
 #include <vector>
 #include <queue>
+#include <functional>
+#include <unordered_set>
 
 namespace asio {
 	
 	const static uint64_t maxSinglePacketSize = 64*1024;
 	
+	/*
+	 *  Every read asks the kernel for all the contiguous free space of the
+	 *  receive ring (never less than minimumReadSize bytes), so a burst of
+	 *  small frames is received with a single async_read_some. Reads for a
+	 *  single huge frame are limited to maxBulkReadSize bytes at once.
+	 */
+	const static uint64_t minimumReadSize = 64*1024;
+	const static uint64_t maxBulkReadSize = 16*1024*1024;
+	
+	/*
+	 *  Send only queues data and returns. A single async_write is in flight
+	 *  per socket; everything queued meanwhile is written by the next one as
+	 *  one gather write. Frames up to smallFrameSize bytes are copied next to
+	 *  each other into a staging buffer, so a burst of small messages becomes
+	 *  one buffer (and one TLS record for ssl). Bigger frames are written
+	 *  directly from the queued Message as header, title and payload.
+	 */
+	const static uint64_t smallFrameSize = 4*1024;
+	const static int closeFlushTimeoutms = 1000;
+	
+	/*
+	 *  Sockets may be used from any thread while their io handlers run on the
+	 *  io thread of their context (see StartIoThreads). Every access to the
+	 *  socket state happens under ioEvent.mutex, and every outstanding
+	 *  asynchronous operation is counted in pendingHandlers, so Close can wait
+	 *  until no handler refers to the socket anymore. Send callbacks run on
+	 *  the io thread and must not close or destroy the socket.
+	 */
 	template<typename T>
 	class Socket {
 	public:
@@ -43,15 +75,42 @@ namespace asio {
 		const Endpoint& GetEndpoint() const;
 		
 		bool Send(const std::vector<uint8_t>& buffer);
+		bool Send(std::vector<uint8_t>&& buffer);
 		bool Send(const Message& msg);
+		bool Send(Message&& msg);
+		// the frame is copied, msg may be reused or released right away
+		bool Send(const FastMessage& msg);
+		
+		bool Flush(int timeoutms=-1);
+		uint64_t GetQueuedSendBytes() const;
+		bool HasSendFailed() const;
+		void SetSendCallback(
+				std::function<void(bool success, uint64_t bytes)> callback);
+		
+		void SetReceiveBufferCapacity(uint64_t bytes);
 		
 		bool HasMessage() const;
 		void GetMessageCompletition(uint64_t&recvd, uint64_t& required);
 		void GetBufferMessageCompletition(uint64_t&recvd, uint64_t& required);
 		bool TryPopMessage(Message& message, int timeoutms=-1);
+		// fails without removing a message bigger than maxFastMessageSize,
+		// pop that one as Message
+		bool TryPopMessage(FastMessage& message, int timeoutms=-1);
+		
+		/*
+		 *  View of the oldest received message, without copying it out of the
+		 *  receive ring. The view stays valid until ConsumeMessage (removes
+		 *  the message), ReleaseMessage (keeps it for the next pop/peek),
+		 *  TryPopMessage or Close. While a view is held, no new data is read
+		 *  into the ring once its free tail space is used up.
+		 */
+		bool TryPeekMessage(MessageView& view, int timeoutms=-1);
+		void ConsumeMessage();
+		void ReleaseMessage();
 		
 		T* GetSocket();
 		
+		// false also after a malformed frame header closed the connection
 		bool Valid() const;
 		
 		template<typename T2>
@@ -63,16 +122,126 @@ namespace asio {
 		
 #ifdef SOCKET_CPP
 		void FetchData(const boost::system::error_code& err, size_t length);
+		void WriteCompleted(const boost::system::error_code& err,
+				size_t length);
 #endif
+		boost::asio::io_context& AssignIoContext();
+		void Interrupt();
+		struct OutboundEntry {
+			NumberBuffer header;
+			Message message;
+			uint64_t stagingBegin;
+			uint64_t stagingEnd;
+			bool large;
+			bool raw;
+		};
+		
+		bool CanSend() const;
+		void BufferMessageCompletition(uint64_t&recvd, uint64_t& required);
+		void InternalConsumeMessage();
+		void InternalReleaseMessage();
+		bool EnqueueMessage(const Message& msg, Message* owned);
+		uint8_t* AppendStaging(uint64_t bytes);
+		OutboundEntry& AppendLarge(bool raw);
+		void ScheduleWrite();
+		void StartWrite();
 		void RequestDataFetch(uint64_t bytes);
+		uint64_t ParseReceivedFrames();
+		bool WaitForMessage(int timeoutms);
+		MessageView GetFrontView() const;
+		
+		struct ReceivedFrame {
+			uint64_t frameSize;
+			uint64_t titleSize;
+			uint64_t dataOffset;
+			uint32_t headerSize;
+		};
+		
+		/*
+		 *  Queue of parsed frames with the interface of std::queue, but kept
+		 *  in one vector that is only compacted, never freed, so a steady
+		 *  stream of frames does not allocate (std::deque frees and
+		 *  allocates a block every few frames).
+		 */
+		class ReceivedFrameQueue {
+		public:
+			
+			ReceivedFrameQueue() : head(0) {}
+			
+			bool empty() const {
+				return head == frames.size();
+			}
+			
+			const ReceivedFrame& front() const {
+				return frames[head];
+			}
+			
+			void emplace(const ReceivedFrame& frame) {
+				if(head && frames.size() == frames.capacity()) {
+					frames.erase(frames.begin(), frames.begin()+head);
+					head = 0;
+				}
+				frames.push_back(frame);
+			}
+			
+			void pop() {
+				if(++head == frames.size()) {
+					frames.clear();
+					head = 0;
+				}
+			}
+			
+		private:
+			
+			std::vector<ReceivedFrame> frames;
+			size_t head;
+		};
 		
 		T* socket;
+		boost::asio::io_context* context;
+		mutable IoEvent ioEvent;
+		uint32_t pendingHandlers;
 		Endpoint endpoint;
-		std::vector<uint8_t> buffer;
-		std::queue<Message> receivedMessages;
-		uint64_t fetchRequestSize;
+		RingBuffer receiveBuffer;
+		HandlerMemory readMemory;
+		HandlerMemory writeMemory;
+		ReceivedFrameQueue receivedFrames;
+		FrameParser frameParser;
+		uint64_t parsedBytes;
+		uint64_t missingBytes;
+		bool fetchPostponed;
+		
+		std::vector<OutboundEntry> pendingEntries;
+		std::vector<OutboundEntry> inFlightEntries;
+		std::vector<uint8_t> pendingStaging;
+		std::vector<uint8_t> inFlightStaging;
+		std::vector<boost::asio::const_buffer> inFlightBuffers;
+		std::function<void(bool success, uint64_t bytes)> sendCallback;
+		uint64_t queuedSendBytes;
+		uint64_t inFlightBytes;
+		bool writeInProgress;
+		bool writeScheduled;
+		bool sendFailed;
+		bool receiveFailed;
 	};
 	
+	/*
+	 *  A server listens with shardsCount acceptors bound to the same endpoint
+	 *  with SO_REUSEPORT (0 means one per io thread), each spread to its own
+	 *  pool context and each keeping acceptsPerShard accepts outstanding, so
+	 *  the kernel spreads incoming connections across cores. Where
+	 *  SO_REUSEPORT does not exist a single acceptor keeps all the accepts
+	 *  outstanding. Call SetSharding before Open; by default a server uses one
+	 *  acceptor with one outstanding accept. With port 0 all shards share the
+	 *  port picked for the first one. Shards that fail to open are dropped,
+	 *  Open throws boost::system::system_error when none could.
+	 *
+	 *  An accepted socket is handed to Accept, which has to call FinishAccept
+	 *  exactly once, possibly later from an io handler (ssl finishes after its
+	 *  asynchronous handshake). Only then the socket is published to
+	 *  TryGetNewSocket or deleted. With maxPendingAccepts set, accept slots
+	 *  pause while that many sockets are still being accepted.
+	 */
 	template<typename T>
 	class Server {
 	public:
@@ -80,6 +249,7 @@ namespace asio {
 		Server();
 		virtual ~Server();
 		
+		void SetSharding(uint32_t shards, uint32_t acceptsPerShard=4);
 		void Open(const Endpoint& endpoint);
 		virtual void Close();
 		
@@ -97,13 +267,30 @@ namespace asio {
 		virtual T* CreateEmptyAcceptingSocket()=0;
 		
 #ifdef SOCKET_CPP
-		void DoAccept(const boost::system::error_code& err);
+		void DoAccept(uint32_t shardId, uint32_t slot,
+				const boost::system::error_code& err);
 #endif
-		virtual bool Accept(T* socket);
+		virtual void Accept(T* socket);
+		void FinishAccept(T* socket, bool accepted);
+		void SetMaxPendingAccepts(uint32_t maxPending);
+		void AsyncAccept(uint32_t shardId, uint32_t slot);
+		
+		struct AcceptorShard {
+			boost::asio::ip::tcp::acceptor* acceptor;
+			boost::asio::io_context* context;
+			std::vector<T*> accepting;
+		};
 		
-		boost::asio::ip::tcp::acceptor* acceptor;
+		std::vector<AcceptorShard> shards;
+		uint32_t shardsCount;
+		uint32_t acceptsPerShard;
+		boost::asio::io_context* context;
+		mutable IoEvent ioEvent;
+		uint32_t pendingHandlers;
 		std::queue<T*> newSockets;
-		T* currentAcceptingSocket;
+		std::unordered_set<T*> pendingAccepts;
+		std::vector<std::pair<uint32_t, uint32_t>> pausedSlots;
+		uint32_t maxPendingAccepts;
 	};
 };
 
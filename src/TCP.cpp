@@ -49,12 +49,49 @@ namespace tcp {
 	bool Socket::Send(const std::vector<uint8_t>& buffer) {
 		return SocketBase::Send(buffer);
 	}
+	bool Socket::Send(std::vector<uint8_t>&& buffer) {
+		return SocketBase::Send(std::move(buffer));
+	}
 	bool Socket::Send(const Message& msg) {
 		return SocketBase::Send(msg);
 	}
+	bool Socket::Send(Message&& msg) {
+		return SocketBase::Send(std::move(msg));
+	}
+	bool Socket::Send(const FastMessage& msg) {
+		return SocketBase::Send(msg);
+	}
+	bool Socket::Flush(int timeoutms) {
+		return SocketBase::Flush(timeoutms);
+	}
+	uint64_t Socket::GetQueuedSendBytes() const {
+		return SocketBase::GetQueuedSendBytes();
+	}
+	bool Socket::HasSendFailed() const {
+		return SocketBase::HasSendFailed();
+	}
+	void Socket::SetSendCallback(
+			std::function<void(bool success, uint64_t bytes)> callback) {
+		SocketBase::SetSendCallback(callback);
+	}
 	bool Socket::TryPopMessage(Message& message, int timeoutms) {
 		return SocketBase::TryPopMessage(message, timeoutms);
 	}
+	bool Socket::TryPopMessage(FastMessage& message, int timeoutms) {
+		return SocketBase::TryPopMessage(message, timeoutms);
+	}
+	bool Socket::TryPeekMessage(MessageView& view, int timeoutms) {
+		return SocketBase::TryPeekMessage(view, timeoutms);
+	}
+	void Socket::ConsumeMessage() {
+		SocketBase::ConsumeMessage();
+	}
+	void Socket::ReleaseMessage() {
+		SocketBase::ReleaseMessage();
+	}
+	void Socket::SetReceiveBufferCapacity(uint64_t bytes) {
+		SocketBase::SetReceiveBufferCapacity(bytes);
+	}
 	void Socket::GetMessageCompletition(uint64_t&recvd, uint64_t& required) {
 		SocketBase::GetMessageCompletition(recvd, required);
 	}
@@ -65,14 +102,12 @@ namespace tcp {
 		return SocketBase::HasMessage();
 	}
 	void Socket::Close() {
-		if(socket)
-			socket->close();
 		SocketBase::Close();
 	}
 	
 	bool Socket::Connect(const Endpoint& endpoint) {
 		Close();
-		socket = new ProtocolSocket(IoContext());
+		socket = new ProtocolSocket(AssignIoContext());
 		boost::system::error_code err;
 		socket->connect(endpoint.TcpEndpoint(), err);
 		if(err) {
@@ -86,7 +121,7 @@ namespace tcp {
 	
 	void Socket::CreateEmptySocket() {
 		Close();
-		socket = new ProtocolSocket(IoContext());
+		socket = new ProtocolSocket(AssignIoContext());
 	}
 	
 	
@@ -98,6 +133,10 @@ namespace tcp {
 	}
 	
 	
+	void Server::SetSharding(uint32_t shards, uint32_t acceptsPerShard) {
+		ServerBase::SetSharding(shards, acceptsPerShard);
+	}
+	
 	void Server::Open(const Endpoint& endpoint) {
 		ServerBase::Open(endpoint);
 	}
@@ -139,12 +178,8 @@ namespace tcp {
 		return socket;
 	}
 	
-	bool Server::Accept(Socket* socket) {
-		if(socket) {
-			socket->FinalizeConnecting();
-			return true;
-		}
-		return false;
+	void Server::Accept(Socket* socket) {
+		FinishAccept(socket, socket->FinalizeConnecting());
 	}
 };
 
@@ -37,8 +37,21 @@ namespace tcp {
 		virtual ~Socket() override;
 		
 		bool Send(const std::vector<uint8_t>& buffer);
+		bool Send(std::vector<uint8_t>&& buffer);
 		bool Send(const Message& msg);
+		bool Send(Message&& msg);
+		bool Send(const FastMessage& msg);
+		bool Flush(int timeoutms=-1);
+		uint64_t GetQueuedSendBytes() const;
+		bool HasSendFailed() const;
+		void SetSendCallback(
+				std::function<void(bool success, uint64_t bytes)> callback);
 		bool TryPopMessage(Message& message, int timeoutms=-1);
+		bool TryPopMessage(FastMessage& message, int timeoutms=-1);
+		bool TryPeekMessage(MessageView& view, int timeoutms=-1);
+		void ConsumeMessage();
+		void ReleaseMessage();
+		void SetReceiveBufferCapacity(uint64_t bytes);
 		void GetMessageCompletition(uint64_t&recvd, uint64_t& required);
 		ProtocolSocket* GetSocket();
 		bool HasMessage() const;
@@ -59,6 +72,7 @@ namespace tcp {
 		Server();
 		virtual ~Server() override;
 		
+		void SetSharding(uint32_t shards, uint32_t acceptsPerShard=4);
 		void Open(const Endpoint& endpoint);
 		virtual void Close() override;
 		
@@ -71,7 +85,7 @@ namespace tcp {
 		virtual bool Valid() const override;
 		
 		virtual Socket* CreateEmptyAcceptingSocket() override;
-		virtual bool Accept(Socket* socket) override;
+		virtual void Accept(Socket* socket) override;
 	};
 };
 
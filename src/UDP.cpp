@@ -21,266 +21,2491 @@
 #endif
 
 #include "UDP.hpp"
+#include "FrameParser.hpp"
 
 #include <string>
 #include <vector>
 #include <functional>
 #include <memory>
 #include <thread>
+#include <mutex>
 #include <map>
 #include <unordered_map>
 #include <queue>
 
 #include <cstring>
+#include <cstddef>
 #include <ctime>
 #include <cstdio>
 #include <cstdlib>
+#include <cmath>
 
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/buffer.hpp>
 #include <boost/asio/ip/udp.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#include <chrono>
+#include <deque>
+#include <algorithm>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <cerrno>
+#endif
 
 namespace udp {
 	
 	Endpoint::Endpoint() {
-		ref = false;
-		ptr = new boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), 0);
+		memset(this, 0, sizeof(Endpoint));
+		family = familyV4;
+		ComputeHash();
+	}
+	
+	Endpoint::Endpoint(const GlobalEndpoint& endpoint) :
+		Endpoint(endpoint.UdpEndpoint()) {
+	}
+	
+	Endpoint::Endpoint(uint16_t port) : Endpoint() {
+		this->port = port;
+		ComputeHash();
+	}
+	
+	Endpoint::Endpoint(const boost::asio::ip::udp::endpoint& endpoint) {
+		memset(this, 0, sizeof(Endpoint));
+		const boost::asio::ip::address address = endpoint.address();
+		if(address.is_v6()) {
+			const boost::asio::ip::address_v6 v6 = address.to_v6();
+			const boost::asio::ip::address_v6::bytes_type bytes =
+				v6.to_bytes();
+			memcpy(this->address, bytes.data(), bytes.size());
+			scopeId = v6.scope_id();
+			family = familyV6;
+		} else {
+			const boost::asio::ip::address_v4::bytes_type bytes =
+				address.to_v4().to_bytes();
+			memcpy(this->address, bytes.data(), bytes.size());
+			family = familyV4;
+		}
+		port = endpoint.port();
+		ComputeHash();
+	}
+	
+	boost::asio::ip::udp::endpoint Endpoint::UdpEndpoint() const {
+		if(family == familyV6) {
+			boost::asio::ip::address_v6::bytes_type bytes;
+			memcpy(bytes.data(), address, bytes.size());
+			return boost::asio::ip::udp::endpoint(
+					boost::asio::ip::address_v6(bytes, scopeId), port);
+		}
+		boost::asio::ip::address_v4::bytes_type bytes;
+		memcpy(bytes.data(), address, bytes.size());
+		return boost::asio::ip::udp::endpoint(
+				boost::asio::ip::address_v4(bytes), port);
+	}
+	
+	void Endpoint::ComputeHash() {
+		// FNV-1a over everything in front of the hash itself
+		const uint8_t* bytes = (const uint8_t*)this;
+		uint32_t h = 2166136261u;
+		for(size_t i=0; i<offsetof(Endpoint, hash); ++i)
+			h = (h ^ bytes[i]) * 16777619u;
+		hash = h;
+	}
+	
+	
+	bool Endpoint::operator < (const Endpoint& r) const {
+		return memcmp(this, &r, offsetof(Endpoint, hash)) < 0;
+	}
+	bool Endpoint::operator == (const Endpoint& r) const {
+		return hash == r.hash && memcmp(this, &r, offsetof(Endpoint, hash)) == 0;
+	}
+	bool Endpoint::operator != (const Endpoint& r) const {
+		return !(*this == r);
+	}
+	
+	Endpoint::operator GlobalEndpoint() const {
+		return GlobalEndpoint(UdpEndpoint());
+	}
+	
+	
+	
+	PeerTable::PeerTable() :
+		freeEntries(none), head(none), tail(none) {
+	}
+	
+	uint64_t PeerTable::Find(const Endpoint& endpoint) const {
+		const uint32_t* peer = ids.Find(endpoint);
+		return peer ? entries[*peer].id : 0;
+	}
+	
+	const Endpoint* PeerTable::Find(uint64_t id) const {
+		const uint32_t* peer = endpoints.Find(id);
+		return peer ? &entries[*peer].endpoint : NULL;
+	}
+	
+	void PeerTable::Insert(const Endpoint& endpoint, uint64_t id,
+			TimePoint now) {
+		Erase(endpoint);
+		Erase(id);
+		uint32_t peer;
+		if(freeEntries != none) {
+			peer = freeEntries;
+			freeEntries = entries[peer].next;
+		} else {
+			peer = entries.size();
+			entries.emplace_back();
+		}
+		Peer& p = entries[peer];
+		p.endpoint = endpoint;
+		p.id = id;
+		p.lastSeen = now;
+		Link(peer);
+		ids.Insert(endpoint, peer);
+		endpoints.Insert(id, peer);
+	}
+	
+	uint64_t PeerTable::Touch(const Endpoint& endpoint, TimePoint now) {
+		const uint32_t* found = ids.Find(endpoint);
+		if(found == NULL)
+			return 0;
+		const uint32_t peer = *found;
+		entries[peer].lastSeen = now;
+		if(peer != tail) {
+			Unlink(peer);
+			Link(peer);
+		}
+		return entries[peer].id;
+	}
+	
+	void PeerTable::Erase(const Endpoint& endpoint) {
+		const uint32_t* peer = ids.Find(endpoint);
+		if(peer)
+			Release(*peer);
+	}
+	
+	void PeerTable::Erase(uint64_t id) {
+		const uint32_t* peer = endpoints.Find(id);
+		if(peer)
+			Release(*peer);
+	}
+	
+	void PeerTable::Clear() {
+		ids.Clear();
+		endpoints.Clear();
+		entries.clear();
+		freeEntries = head = tail = none;
+	}
+	
+	size_t PeerTable::Size() const {
+		return endpoints.Size();
+	}
+	
+	uint64_t PeerTable::Oldest(TimePoint& lastSeen) const {
+		if(head == none)
+			return 0;
+		lastSeen = entries[head].lastSeen;
+		return entries[head].id;
+	}
+	
+	
+	void PeerTable::Link(uint32_t peer) {
+		Peer& p = entries[peer];
+		p.next = none;
+		p.prev = tail;
+		if(tail != none)
+			entries[tail].next = peer;
+		else
+			head = peer;
+		tail = peer;
+	}
+	
+	void PeerTable::Unlink(uint32_t peer) {
+		Peer& p = entries[peer];
+		if(p.prev != none)
+			entries[p.prev].next = p.next;
+		else
+			head = p.next;
+		if(p.next != none)
+			entries[p.next].prev = p.prev;
+		else
+			tail = p.prev;
+	}
+	
+	void PeerTable::Release(uint32_t peer) {
+		Unlink(peer);
+		ids.Erase(entries[peer].endpoint);
+		endpoints.Erase(entries[peer].id);
+		entries[peer].next = freeEntries;
+		freeEntries = peer;
+	}
+	
+	
+	
+	Inbox::Inbox() :
+		freeNodes(none), head(none), tail(none), freeQueues(none),
+		cursor(none), fair(false) {
+	}
+	
+	Message& Inbox::Push(uint64_t peer) {
+		uint32_t queue;
+		if(const uint32_t* found = peerQueue.Find(peer)) {
+			queue = *found;
+		} else {
+			if(freeQueues != none) {
+				queue = freeQueues;
+				freeQueues = queues[queue].ringNext;
+			} else {
+				queue = queues.size();
+				queues.emplace_back();
+			}
+			PeerQueue& q = queues[queue];
+			q.peer = peer;
+			q.head = q.tail = none;
+			// new peers join the round just before the cursor, so they are
+			// served after every peer that already waits
+			if(cursor == none) {
+				q.ringPrev = q.ringNext = queue;
+				cursor = queue;
+			} else {
+				q.ringNext = cursor;
+				q.ringPrev = queues[cursor].ringPrev;
+				queues[q.ringPrev].ringNext = queue;
+				queues[cursor].ringPrev = queue;
+			}
+			peerQueue.Insert(peer, queue);
+		}
+		
+		uint32_t node;
+		if(freeNodes != none) {
+			node = freeNodes;
+			freeNodes = nodes[node].next;
+		} else {
+			node = nodes.size();
+			nodes.emplace_back();
+		}
+		Node& n = nodes[node];
+		n.peer = peer;
+		n.next = none;
+		n.peerNext = none;
+		n.prev = tail;
+		if(tail != none)
+			nodes[tail].next = node;
+		else
+			head = node;
+		tail = node;
+		
+		PeerQueue& q = queues[queue];
+		if(q.tail != none)
+			nodes[q.tail].peerNext = node;
+		else
+			q.head = node;
+		q.tail = node;
+		return n.message;
+	}
+	
+	bool Inbox::PopAny(Message& message, uint64_t& peer) {
+		const uint32_t queue = NextQueue(peer);
+		if(queue == none)
+			return false;
+		message.Swap(nodes[TakeHead(queue)].message);
+		return true;
+	}
+	
+	bool Inbox::Pop(Message& message, uint64_t peer) {
+		const uint32_t* queue = peerQueue.Find(peer);
+		if(queue == NULL)
+			return false;
+		message.Swap(nodes[TakeHead(*queue)].message);
+		return true;
+	}
+	
+	bool Inbox::PopAny(FastMessage& message, uint64_t& peer) {
+		const uint32_t queue = NextQueue(peer);
+		if(queue == none)
+			return false;
+		const Message& taken = nodes[TakeHead(queue)].message;
+		return message.SetMessageBody(taken.title, taken.data);
+	}
+	
+	bool Inbox::Pop(FastMessage& message, uint64_t peer) {
+		const uint32_t* queue = peerQueue.Find(peer);
+		if(queue == NULL)
+			return false;
+		const Message& taken = nodes[TakeHead(*queue)].message;
+		return message.SetMessageBody(taken.title, taken.data);
+	}
+	
+	bool Inbox::Empty() const {
+		return head == none;
+	}
+	
+	bool Inbox::Has(uint64_t peer) const {
+		return peerQueue.Find(peer) != NULL;
+	}
+	
+	void Inbox::Erase(uint64_t peer) {
+		const uint32_t* found = peerQueue.Find(peer);
+		if(found == NULL)
+			return;
+		const uint32_t queue = *found;
+		for(uint32_t node=queues[queue].head; node!=none;) {
+			const uint32_t next = nodes[node].peerNext;
+			Unlink(node);
+			node = next;
+		}
+		ReleaseQueue(queue);
+	}
+	
+	void Inbox::Clear() {
+		nodes.clear();
+		queues.clear();
+		peerQueue.Clear();
+		freeNodes = head = tail = freeQueues = cursor = none;
+	}
+	
+	void Inbox::SetFair(bool fair) {
+		this->fair = fair;
+	}
+	
+	
+	void Inbox::Unlink(uint32_t node) {
+		Node& n = nodes[node];
+		if(n.prev != none)
+			nodes[n.prev].next = n.next;
+		else
+			head = n.next;
+		if(n.next != none)
+			nodes[n.next].prev = n.prev;
+		else
+			tail = n.prev;
+		n.next = freeNodes;
+		freeNodes = node;
+	}
+	
+	uint32_t Inbox::NextQueue(uint64_t& peer) {
+		if(head == none)
+			return none;
+		uint32_t queue;
+		if(fair) {
+			queue = cursor;
+			cursor = queues[queue].ringNext;
+		} else {
+			queue = *peerQueue.Find(nodes[head].peer);
+		}
+		peer = queues[queue].peer;
+		return queue;
+	}
+	
+	uint32_t Inbox::TakeHead(uint32_t queue) {
+		PeerQueue& q = queues[queue];
+		const uint32_t node = q.head;
+		q.head = nodes[node].peerNext;
+		Unlink(node);
+		if(q.head == none)
+			ReleaseQueue(queue);
+		return node;
+	}
+	
+	void Inbox::ReleaseQueue(uint32_t queue) {
+		PeerQueue& q = queues[queue];
+		if(q.ringNext == queue) {
+			cursor = none;
+		} else {
+			queues[q.ringPrev].ringNext = q.ringNext;
+			queues[q.ringNext].ringPrev = q.ringPrev;
+			if(cursor == queue)
+				cursor = q.ringNext;
+		}
+		peerQueue.Erase(q.peer);
+		q.ringNext = freeQueues;
+		freeQueues = queue;
+	}
+	
+	
+	
+	struct BatchIo {
+		BatchIo(uint32_t size);
+		
+		struct SendQueue {
+			SendQueue(uint32_t size);
+			
+			uint32_t queued;
+			std::vector<uint8_t> slab;
+			std::vector<uint32_t> sizes;
+			std::vector<boost::asio::ip::udp::endpoint> endpoints;
+		};
+		
+		uint32_t size;
+		std::vector<uint8_t> recvSlab;
+		// Datagrams are queued into fill while the io thread sends the
+		// other queue from sendFirstUnsent on, a nonzero send.queued means
+		// it is still busy. fill grows past size meanwhile.
+		SendQueue fill;
+		SendQueue send;
+		uint32_t sendFirstUnsent;
+#ifdef __linux__
+		std::vector<mmsghdr> recvHeaders;
+		std::vector<iovec> recvIovecs;
+		std::vector<sockaddr_storage> recvAddresses;
+		std::vector<mmsghdr> sendHeaders;
+		std::vector<iovec> sendIovecs;
+		// first queued datagram of every message and its segment control
+		std::vector<uint32_t> sendFirst;
+		std::vector<uint8_t> sendControl;
+#endif
+	};
+	
+	BatchIo::BatchIo(uint32_t size) :
+		size(size),
+		recvSlab(size*udpMaxDatagramSize),
+		fill(size),
+		send(size),
+		sendFirstUnsent(0) {
+#ifdef __linux__
+		recvHeaders.resize(size);
+		recvIovecs.resize(size);
+		recvAddresses.resize(size);
+		sendHeaders.resize(size);
+		sendIovecs.resize(size);
+		sendFirst.resize(size);
+		sendControl.resize(size*CMSG_SPACE(sizeof(uint16_t)));
+		for(uint32_t i=0; i<size; ++i) {
+			recvIovecs[i].iov_base = recvSlab.data() + i*udpMaxDatagramSize;
+			recvIovecs[i].iov_len = udpMaxDatagramSize;
+			memset(&recvHeaders[i], 0, sizeof(mmsghdr));
+			recvHeaders[i].msg_hdr.msg_name = &recvAddresses[i];
+			recvHeaders[i].msg_hdr.msg_iov = &recvIovecs[i];
+			recvHeaders[i].msg_hdr.msg_iovlen = 1;
+			memset(&sendHeaders[i], 0, sizeof(mmsghdr));
+			sendHeaders[i].msg_hdr.msg_iov = &sendIovecs[i];
+			sendHeaders[i].msg_hdr.msg_iovlen = 1;
+		}
+#endif
+	}
+	
+	BatchIo::SendQueue::SendQueue(uint32_t size) :
+		queued(0),
+		slab(size*udpMaxDatagramSize),
+		sizes(size),
+		endpoints(size) {
+	}
+	
+	
+	
+	// doubled on every failed wait for datagrams, reset by a successful one
+	const int receiveBackoffMaxms = 1000;
+	
+	struct ReceiveBackoff {
+		ReceiveBackoff(boost::asio::io_context& context) :
+			timer(context), delayms(0) {
+		}
+		
+		boost::asio::steady_timer timer;
+		int delayms;
+	};
+	
+	
+	
+	// one segmented send stays below the 64KiB limit of an IP packet
+	const size_t offloadMaxBytes = 65000;
+	const uint32_t offloadMaxSegments = 64;
+	const size_t offloadRecvBufferSize = 65536;
+	
+	struct Offload {
+		Offload() : gso(false), gro(false) {
+		}
+		
+		bool gso;
+		bool gro;
+		std::vector<uint8_t> sendBuffer;
+		std::vector<uint8_t> recvBuffer;
+	};
+	
+#ifdef UDP_SEGMENT
+	static void SetSegmentSize(msghdr& header, uint8_t* control,
+			uint16_t size) {
+		header.msg_control = control;
+		header.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+		cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+		cmsg->cmsg_level = IPPROTO_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+	}
+#endif
+	
+	
+	
+	enum ControlType : uint8_t {
+		reliableData = 1,
+		reliableAck = 2,
+		fragmentData = 3,
+		cookieChallenge = 4,
+		cookieEcho = 5,
+		mtuProbe = 6,
+		mtuAck = 7
+	};
+	
+	// zero marker, type, sequence, ack, ack bits; acks carry no sequence
+	const size_t reliableHeaderSize = 14;
+	
+	// reliable payloads starting with a zero byte are chunks of a larger
+	// frame, the second byte tells whether more chunks follow
+	const size_t reliableChunkHeaderSize = 2;
+	const size_t reliableChunkSize = udpMessageSizeLimit - reliableHeaderSize -
+		reliableChunkHeaderSize;
+	
+	// zero marker, type, message id, fragment index, fragment count
+	const size_t fragmentHeaderSize = 10;
+	const size_t fragmentSize = udpMessageSizeLimit - fragmentHeaderSize;
+	const size_t maxFragmentSize = udpMaxDatagramSize - fragmentHeaderSize;
+	const uint32_t maxFragments = (udpMaxMessageSize + fragmentSize - 1) /
+		fragmentSize;
+	
+	// zero marker, type, cookie; as long as a reliable header, so any
+	// reliable datagram may be answered with a challenge
+	const size_t cookieSize = 12;
+	const size_t cookieDatagramSize = 2 + cookieSize;
+	
+	// zero marker, type, probe id, then padding; acks carry the probe id and
+	// the size of the probe as received
+	const size_t mtuProbeHeaderSize = 6;
+	const size_t mtuAckSize = 10;
+	// the search stops when the tested range is narrower
+	const uint32_t mtuSearchGranularity = 32;
+	
+	static inline void Put16(uint8_t* p, uint16_t value) {
+		p[0] = value;
+		p[1] = value >> 8;
+	}
+	
+	static inline uint16_t Get16(const uint8_t* p) {
+		return (uint16_t)p[0] | ((uint16_t)p[1]<<8);
+	}
+	
+	static inline void Put32(uint8_t* p, uint32_t value) {
+		p[0] = value;
+		p[1] = value >> 8;
+		p[2] = value >> 16;
+		p[3] = value >> 24;
+	}
+	
+	static inline uint32_t Get32(const uint8_t* p) {
+		return (uint32_t)p[0] | ((uint32_t)p[1]<<8) | ((uint32_t)p[2]<<16) |
+			((uint32_t)p[3]<<24);
+	}
+	
+	// full sequence number nearest to base with the given lower 32 bits
+	static inline uint64_t ExtendSequence(uint64_t base, uint32_t sequence) {
+		return base + (int64_t)(int32_t)(sequence - (uint32_t)base);
+	}
+	
+	struct ReliableChannel {
+		struct Pending {
+			std::vector<uint8_t> datagram;
+			std::chrono::steady_clock::time_point sentAt;
+			uint32_t transmissions;
+		};
+		
+		ReliableChannel(const Endpoint& endpoint) :
+			endpoint(endpoint), nextSequence(0), expected(0),
+			partialDropped(false), srttms(0), rttvarms(0),
+			rtoms(reliableInitialRtoms), hasRtt(false), ackPending(false),
+			cwnd(reliableInitialCwnd), ssthresh(reliableWindow),
+			cwndAcks(0), recoveryEnd(0) {
+		}
+		
+		Endpoint endpoint;
+		
+		uint64_t nextSequence;
+		std::map<uint64_t, Pending> unacked;
+		std::deque<std::vector<uint8_t>> backlog;
+		
+		uint64_t expected;
+		std::map<uint64_t, std::vector<uint8_t>> outOfOrder;
+		std::vector<uint8_t> partial;
+		bool partialDropped;
+		
+		double srttms;
+		double rttvarms;
+		int rtoms;
+		bool hasRtt;
+		bool ackPending;
+		
+		// congestion window in messages, slow start below ssthresh and one
+		// more message per window of acks above it
+		uint32_t cwnd;
+		uint32_t ssthresh;
+		uint32_t cwndAcks;
+		uint64_t recoveryEnd;
+		
+		void Acknowledged() {
+			if(cwnd < ssthresh) {
+				++cwnd;
+			} else if(++cwndAcks >= cwnd) {
+				cwndAcks = 0;
+				++cwnd;
+			}
+			cwnd = std::min(cwnd, reliableWindow);
+		}
+		
+		// Halves the window once per window of data in flight. Timeouts do
+		// not restart from a minimal window, a lossy link is not
+		// necessarily a congested one.
+		void Lost(uint64_t sequence) {
+			if(sequence < recoveryEnd)
+				return;
+			ssthresh = std::max<uint32_t>(unacked.size()/2,
+					reliableMinCwnd);
+			cwnd = ssthresh;
+			cwndAcks = 0;
+			recoveryEnd = nextSequence;
+		}
+	};
+	
+	// every reliable datagram carries the current acknowledgement
+	static void WriteReliableAck(ReliableChannel& channel, uint8_t* header) {
+		uint32_t bits = 0;
+		for(uint32_t i=0; i<32; ++i)
+			if(channel.outOfOrder.count(channel.expected+1+i))
+				bits |= 1u << i;
+		Put32(header+6, channel.expected);
+		Put32(header+10, bits);
+		channel.ackPending = false;
+	}
+	
+	struct ReliableState {
+		ReliableState(boost::asio::io_context& context) :
+			timer(context), timerArmed(false) {
+		}
+		
+		~ReliableState() {
+			channels.ForEach([](uint64_t, ReliableChannel* channel) {
+					delete channel;
+				});
+		}
+		
+		boost::asio::steady_timer timer;
+		bool timerArmed;
+		OpenHashMap<uint64_t, ReliableChannel*, IdHash> channels;
+		std::vector<uint64_t> acksPending;
+	};
+	
+	
+	
+	struct Reassembler {
+		const static uint32_t none = ~(uint32_t)0;
+		
+		struct Key {
+			uint64_t peer;
+			uint32_t messageId;
+			
+			inline bool operator == (const Key& r) const {
+				return peer == r.peer && messageId == r.messageId;
+			}
+		};
+		
+		struct KeyHash {
+			inline size_t operator()(const Key& key) const {
+				return IdHash()(key.peer ^ ((uint64_t)key.messageId << 32));
+			}
+		};
+		
+		struct Partial {
+			Key key;
+			uint16_t count;
+			uint16_t received;
+			// every fragment but the last is fragmentLength long
+			uint32_t fragmentLength;
+			uint32_t lastSize;
+			std::chrono::steady_clock::time_point started;
+			bool used;
+		};
+		
+		Reassembler() :
+			slab(udpFragmentPoolSize*fragmentSize),
+			slotNext(udpFragmentPoolSize, none),
+			partials(udpMaxReassemblies),
+			fragments(udpMaxReassemblies*maxFragments, none) {
+			freeSlots.reserve(udpFragmentPoolSize);
+			for(uint32_t i=udpFragmentPoolSize; i>0; --i)
+				freeSlots.emplace_back(i-1);
+			freePartials.reserve(udpMaxReassemblies);
+			for(uint32_t i=udpMaxReassemblies; i>0; --i) {
+				partials[i-1].used = false;
+				freePartials.emplace_back(i-1);
+			}
+			assembled.reserve(udpMaxMessageSize);
+			lastSweep = std::chrono::steady_clock::now();
+		}
+		
+		// Returns the assembled frame once the last missing fragment
+		// arrives. It stays valid until the next call.
+		const std::vector<uint8_t>* Add(uint64_t peer, uint32_t messageId,
+				uint16_t index, uint16_t count, const uint8_t* data,
+				size_t size) {
+			if(count == 0 || count > maxFragments || index >= count ||
+					size == 0 || size > maxFragmentSize ||
+					(index+1 < count && size < fragmentSize) ||
+					(size_t)(count-1)*size >= udpMaxMessageSize)
+				return NULL;
+			const auto now = std::chrono::steady_clock::now();
+			if(now - lastSweep >= std::chrono::milliseconds(
+						udpReassemblyTimeoutms/4))
+				Sweep(now);
+			
+			const Key key{peer, messageId};
+			uint32_t partial;
+			if(const uint32_t* found = active.Find(key)) {
+				partial = *found;
+				if(partials[partial].count != count)
+					return NULL;
+			} else {
+				const uint32_t* peerCount = perPeer.Find(peer);
+				if(peerCount && *peerCount >= udpMaxReassembliesPerPeer)
+					Release(Oldest(peer, none));
+				if(freePartials.empty())
+					Release(Oldest(0, none));
+				partial = freePartials.back();
+				freePartials.pop_back();
+				Partial& p = partials[partial];
+				p.key = key;
+				p.count = count;
+				p.received = 0;
+				p.fragmentLength = 0;
+				p.lastSize = 0;
+				p.started = now;
+				p.used = true;
+				active.Insert(key, partial);
+				const uint32_t* counted = perPeer.Find(peer);
+				perPeer.Insert(peer, counted ? *counted+1 : 1);
+			}
+			
+			Partial& p = partials[partial];
+			if(fragments[partial*maxFragments + index] != none)
+				return NULL;
+			if(index+1 < count) {
+				if(p.fragmentLength == 0)
+					p.fragmentLength = size;
+				else if(p.fragmentLength != size)
+					return NULL;
+			}
+			// a fragment takes as many slots as it needs, chained; a single
+			// message never fills the pool, so some other message always
+			// holds slots that can be reclaimed
+			const uint32_t slots = (size + fragmentSize - 1) / fragmentSize;
+			while(freeSlots.size() < slots)
+				Release(Oldest(0, partial));
+			uint32_t* link = &fragments[partial*maxFragments + index];
+			for(size_t offset=0; offset<size; offset+=fragmentSize) {
+				const uint32_t slot = freeSlots.back();
+				freeSlots.pop_back();
+				memcpy(slab.data() + slot*fragmentSize, data+offset,
+						std::min(fragmentSize, size-offset));
+				*link = slot;
+				link = &slotNext[slot];
+			}
+			if(index+1 == count)
+				p.lastSize = size;
+			if(++p.received < count)
+				return NULL;
+			
+			if(count > 1 && p.lastSize > p.fragmentLength) {
+				Release(partial);
+				return NULL;
+			}
+			const size_t length = count > 1 ? p.fragmentLength : p.lastSize;
+			assembled.resize((size_t)(count-1)*length + p.lastSize);
+			for(uint32_t i=0; i<count; ++i) {
+				uint8_t* out = assembled.data() + (size_t)i*length;
+				size_t left = i+1 < count ? length : p.lastSize;
+				for(uint32_t s=fragments[partial*maxFragments + i]; left;
+						s=slotNext[s]) {
+					const size_t chunk = std::min(fragmentSize, left);
+					memcpy(out, slab.data() + s*fragmentSize, chunk);
+					out += chunk;
+					left -= chunk;
+				}
+			}
+			Release(partial);
+			return &assembled;
+		}
+		
+		void Erase(uint64_t peer) {
+			if(perPeer.Find(peer) == NULL)
+				return;
+			for(uint32_t i=0; i<udpMaxReassemblies; ++i)
+				if(partials[i].used && partials[i].key.peer == peer)
+					Release(i);
+		}
+		
+		// oldest message in assembly, of the given peer unless peer is 0
+		uint32_t Oldest(uint64_t peer, uint32_t except) const {
+			uint32_t oldest = none;
+			for(uint32_t i=0; i<udpMaxReassemblies; ++i) {
+				const Partial& p = partials[i];
+				if(!p.used || i == except || (peer && p.key.peer != peer))
+					continue;
+				if(oldest == none || p.started < partials[oldest].started)
+					oldest = i;
+			}
+			return oldest;
+		}
+		
+		void Sweep(std::chrono::steady_clock::time_point now) {
+			lastSweep = now;
+			const auto timeout = std::chrono::milliseconds(
+					udpReassemblyTimeoutms);
+			for(uint32_t i=0; i<udpMaxReassemblies; ++i)
+				if(partials[i].used && now - partials[i].started >= timeout)
+					Release(i);
+		}
+		
+		void Release(uint32_t partial) {
+			Partial& p = partials[partial];
+			for(uint32_t i=0; i<p.count; ++i) {
+				uint32_t& first = fragments[partial*maxFragments + i];
+				for(uint32_t slot=first; slot!=none;) {
+					const uint32_t next = slotNext[slot];
+					slotNext[slot] = none;
+					freeSlots.emplace_back(slot);
+					slot = next;
+				}
+				first = none;
+			}
+			active.Erase(p.key);
+			uint32_t* peerCount = perPeer.Find(p.key.peer);
+			if(--*peerCount == 0)
+				perPeer.Erase(p.key.peer);
+			p.used = false;
+			freePartials.emplace_back(partial);
+		}
+		
+		std::vector<uint8_t> slab;
+		// next slot of the same fragment
+		std::vector<uint32_t> slotNext;
+		std::vector<uint32_t> freeSlots;
+		std::vector<Partial> partials;
+		std::vector<uint32_t> freePartials;
+		// first slab slot of every fragment, maxFragments entries per partial
+		std::vector<uint32_t> fragments;
+		OpenHashMap<Key, uint32_t, KeyHash> active;
+		OpenHashMap<uint64_t, uint32_t, IdHash> perPeer;
+		std::vector<uint8_t> assembled;
+		std::chrono::steady_clock::time_point lastSweep;
+	};
+	
+	
+	
+	static inline uint64_t Rotl64(uint64_t value, int bits) {
+		return (value << bits) | (value >> (64-bits));
+	}
+	
+	// SipHash-2-4 with 128 bit output, keyed and without allocations
+	static void SipHash128(const uint8_t* key, const uint8_t* data,
+			size_t size, uint8_t* digest) {
+		auto get64 = [](const uint8_t* p)->uint64_t {
+			return (uint64_t)Get32(p) | ((uint64_t)Get32(p+4) << 32);
+		};
+		const uint64_t k0 = get64(key), k1 = get64(key+8);
+		uint64_t v0 = 0x736f6d6570736575ull ^ k0;
+		uint64_t v1 = 0x646f72616e646f6dull ^ k1 ^ 0xee;
+		uint64_t v2 = 0x6c7967656e657261ull ^ k0;
+		uint64_t v3 = 0x7465646279746573ull ^ k1;
+		auto rounds = [&](int count) {
+			for(int i=0; i<count; ++i) {
+				v0 += v1; v1 = Rotl64(v1, 13); v1 ^= v0; v0 = Rotl64(v0, 32);
+				v2 += v3; v3 = Rotl64(v3, 16); v3 ^= v2;
+				v0 += v3; v3 = Rotl64(v3, 21); v3 ^= v0;
+				v2 += v1; v1 = Rotl64(v1, 17); v1 ^= v2; v2 = Rotl64(v2, 32);
+			}
+		};
+		const size_t whole = size & ~(size_t)7;
+		for(size_t offset=0; offset<whole; offset+=8) {
+			const uint64_t m = get64(data+offset);
+			v3 ^= m;
+			rounds(2);
+			v0 ^= m;
+		}
+		uint64_t last = (uint64_t)size << 56;
+		for(size_t i=whole; i<size; ++i)
+			last |= (uint64_t)data[i] << ((i-whole)*8);
+		v3 ^= last;
+		rounds(2);
+		v0 ^= last;
+		v2 ^= 0xee;
+		rounds(4);
+		const uint64_t low = v0 ^ v1 ^ v2 ^ v3;
+		v1 ^= 0xdd;
+		rounds(4);
+		const uint64_t high = v0 ^ v1 ^ v2 ^ v3;
+		Put32(digest, low);
+		Put32(digest+4, low >> 32);
+		Put32(digest+8, high);
+		Put32(digest+12, high >> 32);
+	}
+	
+	struct CookieGate {
+		bool Init() {
+			return RAND_bytes(secret, sizeof(secret)) == 1;
+		}
+		
+		static uint64_t Slot() {
+			return std::chrono::duration_cast<std::chrono::milliseconds>(
+					std::chrono::steady_clock::now().time_since_epoch())
+				.count() / udpCookieLifetimems;
+		}
+		
+		void Make(const Endpoint& endpoint, uint64_t slot,
+				uint8_t* cookie) const {
+			uint8_t input[31];
+			memcpy(input, endpoint.address, 16);
+			Put32(input+16, endpoint.scopeId);
+			Put16(input+20, endpoint.port);
+			input[22] = endpoint.family;
+			Put32(input+23, slot);
+			Put32(input+27, slot >> 32);
+			uint8_t digest[16];
+			SipHash128(secret, input, sizeof(input), digest);
+			memcpy(cookie, digest, cookieSize);
+		}
+		
+		// accepts cookies of the current and the previous time slot
+		bool Verify(const Endpoint& endpoint, const uint8_t* cookie) const {
+			const uint64_t slot = Slot();
+			uint8_t expected[cookieSize];
+			for(uint64_t age=0; age<2 && age<=slot; ++age) {
+				Make(endpoint, slot-age, expected);
+				if(CRYPTO_memcmp(expected, cookie, cookieSize) == 0)
+					return true;
+			}
+			return false;
+		}
+		
+		uint8_t secret[16];
+	};
+	
+	
+	
+	struct Aggregator {
+		struct Pending {
+			Endpoint endpoint;
+			uint32_t size;
+			uint8_t data[udpMaxDatagramSize];
+		};
+		
+		Aggregator(int delayms) :
+			used(0), delayms(delayms), timerArmed(false) {
+		}
+		
+		// the first used entries are the datagrams being filled, the rest
+		// stay allocated for later ones
+		std::deque<Pending> pending;
+		uint32_t used;
+		OpenHashMap<Endpoint, uint32_t, EndpointHash> index;
+		int delayms;
+		std::unique_ptr<boost::asio::steady_timer> timer;
+		bool timerArmed;
+	};
+	
+	
+	
+	struct PathMtu {
+		using TimePoint = std::chrono::steady_clock::time_point;
+		
+		struct Peer {
+			uint32_t size;
+			// range searched, low is known to pass
+			uint32_t low;
+			uint32_t high;
+			// size of the probe in flight, 0 when none is
+			uint32_t probeSize;
+			uint32_t probeId;
+			uint32_t attempts;
+			bool searching;
+			// next probe or probe timeout, max while the peer is not sent to
+			TimePoint next;
+			TimePoint searched;
+			TimePoint used;
+		};
+		
+		PathMtu() :
+			timerArmed(false), nextProbeId(0) {
+		}
+		
+		OpenHashMap<uint64_t, Peer, IdHash> peers;
+		std::unique_ptr<boost::asio::steady_timer> timer;
+		TimePoint timerDeadline;
+		bool timerArmed;
+		uint32_t nextProbeId;
+		std::vector<uint8_t> probe;
+		std::vector<uint64_t> due;
+	};
+	
+	
+	
+	Socket::Socket() {
+		nextEmptyId = 1;
+		sock = NULL;
+		context = NULL;
+		pendingHandlers = 0;
+		flushScheduled = false;
+		nextFragmentedId = 0;
+		maxPeers = udpMaxPeers;
+		peerIdleTimeoutms = udpPeerIdleTimeoutms;
+		evictionPosted = false;
+		owner = NULL;
+		recvEndpoint = new boost::asio::ip::udp::endpoint;
+	}
+	
+	Socket::~Socket() {
+		Close();
+		delete recvEndpoint;
+	}
+	
+	void Socket::Open(const GlobalEndpoint& endpoint, bool reusePort) {
+		Close();
+		const boost::asio::ip::udp::endpoint udpEndpoint =
+			Endpoint(endpoint).UdpEndpoint();
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		context = &AcquireIoContext();
+		sock = new boost::asio::ip::udp::socket(*context);
+		sock->open(udpEndpoint.protocol());
+#ifdef SO_REUSEPORT
+		if(reusePort)
+			sock->set_option(boost::asio::detail::socket_option::boolean<
+					SOL_SOCKET, SO_REUSEPORT>(true));
+#endif
+		sock->bind(udpEndpoint);
+		// datagrams are sent with the socket locked, a full socket buffer
+		// drops them instead of stalling every other user of the socket
+		sock->non_blocking(true);
+		if(offload)
+			ApplyOffload();
+		if(pmtu)
+			ApplyMtuDiscovery();
+		reliable.reset(new ReliableState(*context));
+		StartReceive();
+	}
+	
+	void Socket::Close() {
+		Flush();
+		{
+			std::lock_guard<std::mutex> lock(ioEvent.mutex);
+			// the socket and timers are used only by the io thread
+			if(sock) {
+				RunOnIoThread(context, ioEvent, pendingHandlers, [this]() {
+						boost::system::error_code err;
+						sock->close(err);
+						if(reliable)
+							reliable->timer.cancel();
+						if(aggregator && aggregator->timer)
+							aggregator->timer->cancel();
+						if(pmtu && pmtu->timer)
+							pmtu->timer->cancel();
+						if(receiveBackoff)
+							receiveBackoff->timer.cancel();
+					});
+			}
+		}
+		WaitForPendingHandlers(context, ioEvent, pendingHandlers);
+		
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		if(sock) {
+			delete sock;
+			sock = NULL;
+		}
+		if(aggregator) {
+			aggregator->timer.reset();
+			aggregator->timerArmed = false;
+			aggregator->used = 0;
+			aggregator->index.Clear();
+		}
+		if(pmtu) {
+			pmtu->timer.reset();
+			pmtu->timerArmed = false;
+			pmtu->peers.Clear();
+		}
+		receiveBackoff.reset();
+		if(context) {
+			ReleaseIoContext(context);
+			context = NULL;
+		}
+		flushScheduled = false;
+		if(batch) {
+			batch->fill.queued = 0;
+			batch->send.queued = 0;
+		}
+		reliable.reset();
+		reassembler.reset();
+		evicted.clear();
+		evictionPosted = false;
+		peers.Clear();
+		inbox.Clear();
+		nextEmptyId = 1;
+	}
+	
+	
+	void Socket::SetBatching(uint32_t batchSize) {
+		Flush();
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		if(batchSize > 1)
+			batch.reset(new BatchIo(batchSize));
+		else
+			batch.reset();
+	}
+	
+	void Socket::SetOffload(bool enable) {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		if(sock) {
+			fprintf(stderr, "\n udp::Socket::SetOffload has to be called"
+					" before Open");
+			return;
+		}
+		if(enable && !offload)
+			offload.reset(new Offload());
+		else if(!enable)
+			offload.reset();
+	}
+	
+	void Socket::ApplyOffload() {
+		offload->gso = false;
+		offload->gro = false;
+#ifdef UDP_SEGMENT
+		int size = 0;
+		socklen_t length = sizeof(size);
+		offload->gso = getsockopt(sock->native_handle(), IPPROTO_UDP,
+				UDP_SEGMENT, &size, &length) == 0;
+#endif
+#ifdef UDP_GRO
+		int one = 1;
+		offload->gro = setsockopt(sock->native_handle(), IPPROTO_UDP, UDP_GRO,
+				&one, sizeof(one)) == 0;
+		if(offload->gro)
+			offload->recvBuffer.resize(offloadRecvBufferSize);
+#endif
+	}
+	
+	void Socket::SetAggregation(bool enable, int delayms) {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		if(enable) {
+			if(aggregator)
+				aggregator->delayms = delayms;
+			else
+				aggregator.reset(new Aggregator(delayms));
+		} else if(aggregator) {
+			FlushAggregated(NULL);
+			aggregator.reset();
+		}
 	}
 	
-	Endpoint::Endpoint(bool empty) {
-		ref = false;
-		ptr = NULL;
+	bool Socket::SetCookieGate(bool enable) {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		if(!enable) {
+			cookies.reset();
+		} else if(!cookies) {
+			std::unique_ptr<CookieGate> gate(new CookieGate());
+			if(!gate->Init()) {
+				fprintf(stderr, "\n Cannot generate UDP cookie secret");
+				return false;
+			}
+			cookies = std::move(gate);
+		}
+		return true;
 	}
 	
-	Endpoint::Endpoint(bool ref, boost::asio::ip::udp::endpoint* ptr) {
-		this->ref = ref;
-		if(ref)
-			this->ptr = ptr;
+	void Socket::SetPathMtuDiscovery(bool enable) {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		if(enable == (pmtu != NULL))
+			return;
+		if(enable)
+			pmtu.reset(new PathMtu());
 		else
-			this->ptr = new boost::asio::ip::udp::endpoint(*);
+			pmtu.reset();
+		if(sock)
+			ApplyMtuDiscovery();
+	}
+	
+	void Socket::ApplyMtuDiscovery() {
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+		// probes must not be fragmented on the way, and have to pass even
+		// when the kernel learned a smaller path MTU before
+		const int mode = pmtu ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT;
+		if(sock->local_endpoint().address().is_v4()) {
+			setsockopt(sock->native_handle(), IPPROTO_IP, IP_MTU_DISCOVER,
+					&mode, sizeof(mode));
+		} else {
+			const int mode6 = pmtu ? IPV6_PMTUDISC_PROBE : IPV6_PMTUDISC_WANT;
+			setsockopt(sock->native_handle(), IPPROTO_IPV6,
+					IPV6_MTU_DISCOVER, &mode6, sizeof(mode6));
+		}
+#endif
+	}
+	
+	void Socket::Flush() {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		FlushAggregated(NULL);
+		FlushSendQueue();
+	}
+	
+	
+	bool Socket::Send(const std::vector<uint8_t>& buffer,
+			const Endpoint& endpoint) {
+		std::array<boost::asio::const_buffer, 1> buffers = {
+			boost::asio::buffer(buffer)};
+		return SendBuffers(buffers, endpoint);
+	}
+	bool Socket::Send(const std::vector<uint8_t>& buffer, uint64_t id) {
+		Endpoint endpoint;
+		if(FindEndpoint(id, endpoint))
+			return Send(buffer, endpoint);
+		return false;
+	}
+	bool Socket::Send(const std::vector<uint8_t>& buffer,
+			const GlobalEndpoint& endpoint) {
+		Endpoint end(endpoint);
+		return Send(buffer, end);
+	}
+	bool Socket::Send(const Message& message, const GlobalEndpoint& endpoint) {
+		Endpoint end(endpoint);
+		return Send(message, end);
+	}
+	bool Socket::Send(const Message& message, const Endpoint& endpoint) {
+		NumberBuffer header;
+		std::array<boost::asio::const_buffer, 3> buffers;
+		CreateFrameBuffers(message, header, buffers);
+		return SendBuffers(buffers, endpoint);
+	}
+	bool Socket::Send(const FastMessage& message,
+			const GlobalEndpoint& endpoint) {
+		Endpoint end(endpoint);
+		return Send(message, end);
+	}
+	bool Socket::Send(const FastMessage& message, const Endpoint& endpoint) {
+		std::array<boost::asio::const_buffer, 1> buffers = {
+			boost::asio::buffer(message.buffer, message.wholeMessageLength)};
+		return SendBuffers(buffers, endpoint);
+	}
+	bool Socket::Send(const FastMessage& message, uint64_t id) {
+		Endpoint endpoint;
+		if(FindEndpoint(id, endpoint))
+			return Send(message, endpoint);
+		return false;
+	}
+	
+	template<size_t N>
+	bool Socket::SendBuffers(
+			const std::array<boost::asio::const_buffer, N>& buffers,
+			const Endpoint& endpoint) {
+		const size_t size = boost::asio::buffer_size(buffers);
+		if(size > udpMaxMessageSize)
+			return false;
+		std::unique_lock<std::mutex> lock(ioEvent.mutex);
+		if(sock == NULL)
+			return false;
+		if(batch && batch->fill.queued >= batch->size && batch->send.queued &&
+				IsIoThreadContext(context) &&
+				!context->get_executor().running_in_this_thread()) {
+			// the io thread is behind, waiting for it here spares growing the
+			// queue and dropping it when it is full
+			lock.unlock();
+			IoContextWaitFor(context, ioEvent, [this]()->bool {
+					return sock == NULL || !batch ||
+						batch->fill.queued < batch->size ||
+						batch->send.queued == 0;
+				}, udpSendQueueWaitms);
+			lock.lock();
+			if(sock == NULL)
+				return false;
+		}
+		if(size > udpMessageSizeLimit || aggregator || pmtu) {
+			const size_t datagramSize = InternalDatagramSize(endpoint);
+			if(size > datagramSize) {
+				// keeps the order of frames sent to this endpoint
+				FlushAggregated(&endpoint);
+				fragmentBuffer.resize(size);
+				boost::asio::buffer_copy(boost::asio::buffer(fragmentBuffer),
+						buffers);
+				return SendFragmented(endpoint, fragmentBuffer.data(), size,
+						datagramSize);
+			}
+			if(aggregator) {
+				boost::asio::buffer_copy(boost::asio::buffer(
+							Aggregate(endpoint, size, datagramSize), size),
+						buffers);
+				return true;
+			}
+		}
+		if(batch) {
+			boost::asio::buffer_copy(boost::asio::buffer(
+						QueueDatagram(endpoint, size), size), buffers);
+			DatagramQueued();
+			return true;
+		}
+		// Close deletes the socket once it gets the lock, so it is held for
+		// the send, which cannot block
+		boost::system::error_code err;
+		sock->send_to(buffers, endpoint.UdpEndpoint(), 0, err);
+		if(err)
+			return false;
+		return true;
+	}
+	bool Socket::Send(const Message& message, uint64_t id) {
+		Endpoint endpoint;
+		if(FindEndpoint(id, endpoint))
+			return Send(message, endpoint);
+		return false;
+	}
+	
+	bool Socket::SendDatagram(const Endpoint& endpoint, const uint8_t* data,
+			size_t size) {
+		if(sock == NULL || size > udpMaxDatagramSize)
+			return false;
+		if(batch) {
+			memcpy(QueueDatagram(endpoint, size), data, size);
+			DatagramQueued();
+			return true;
+		}
+		boost::system::error_code err;
+		sock->send_to(boost::asio::buffer(data, size), endpoint.UdpEndpoint(),
+				0, err);
+		return !err;
+	}
+	
+	bool Socket::SendFragmented(const Endpoint& endpoint, const uint8_t* data,
+			size_t size, size_t datagramSize) {
+		const uint32_t messageId = nextFragmentedId++;
+		const size_t length = datagramSize - fragmentHeaderSize;
+		const uint16_t count = (size + length - 1) / length;
+		if(offload && offload->gso && !batch) {
+			// every fragment but the last fills a whole datagram, so they
+			// are laid out back to back as segments of one send
+			std::vector<uint8_t>& buffer = offload->sendBuffer;
+			buffer.resize(count*fragmentHeaderSize + size);
+			for(uint16_t i=0; i<count; ++i) {
+				uint8_t* datagram = buffer.data() + i*datagramSize;
+				const size_t offset = (size_t)i*length;
+				datagram[0] = 0;
+				datagram[1] = fragmentData;
+				Put32(datagram+2, messageId);
+				Put16(datagram+6, i);
+				Put16(datagram+8, count);
+				memcpy(datagram+fragmentHeaderSize, data+offset,
+						std::min(length, size-offset));
+			}
+			return SendSegmented(endpoint, buffer.data(), buffer.size(),
+					datagramSize);
+		}
+		uint8_t datagram[udpMaxDatagramSize];
+		datagram[0] = 0;
+		datagram[1] = fragmentData;
+		Put32(datagram+2, messageId);
+		Put16(datagram+8, count);
+		for(uint16_t i=0; i<count; ++i) {
+			const size_t offset = (size_t)i*length;
+			const size_t part = std::min(length, size-offset);
+			Put16(datagram+6, i);
+			memcpy(datagram+fragmentHeaderSize, data+offset, part);
+			if(!SendDatagram(endpoint, datagram, fragmentHeaderSize+part))
+				return false;
+		}
+		return true;
+	}
+	
+	
+	bool Socket::SendSegmented(const Endpoint& endpoint, const uint8_t* data,
+			size_t size, size_t segmentSize) {
+		size_t offset = 0;
+#ifdef UDP_SEGMENT
+		const boost::asio::ip::udp::endpoint to = endpoint.UdpEndpoint();
+		const size_t perSend = std::min<size_t>(offloadMaxSegments,
+				offloadMaxBytes/segmentSize) * segmentSize;
+		uint8_t control[CMSG_SPACE(sizeof(uint16_t))];
+		while(offset < size && offload->gso) {
+			const size_t length = std::min(perSend, size-offset);
+			iovec iov;
+			iov.iov_base = (void*)(data+offset);
+			iov.iov_len = length;
+			msghdr header;
+			memset(&header, 0, sizeof(header));
+			header.msg_name = (void*)to.data();
+			header.msg_namelen = to.size();
+			header.msg_iov = &iov;
+			header.msg_iovlen = 1;
+			if(length > segmentSize)
+				SetSegmentSize(header, control, segmentSize);
+			if(sendmsg(sock->native_handle(), &header, 0) >= 0) {
+				offset += length;
+			} else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				// no room in the socket buffer, the rest of the message is
+				// lost as if the kernel dropped it, waiting here would hold
+				// the socket locked
+				return false;
+			} else if(errno == EIO || errno == EINVAL || errno == EOPNOTSUPP) {
+				// the route or the device cannot segment, send one by one
+				offload->gso = false;
+			} else if(errno != EINTR) {
+				fprintf(stderr, "\n Error while sending: %s", strerror(errno));
+				return false;
+			}
+		}
+#endif
+		for(; offset<size; offset+=segmentSize)
+			if(!SendDatagram(endpoint, data+offset,
+						std::min(segmentSize, size-offset)))
+				return false;
+		return true;
+	}
+	
+	uint8_t* Socket::Aggregate(const Endpoint& endpoint, size_t size,
+			size_t datagramSize) {
+		uint32_t slot;
+		if(const uint32_t* found = aggregator->index.Find(endpoint)) {
+			slot = *found;
+			Aggregator::Pending& pending = aggregator->pending[slot];
+			if(pending.size + size > datagramSize) {
+				SendDatagram(pending.endpoint, pending.data, pending.size);
+				pending.size = 0;
+			}
+		} else {
+			slot = aggregator->used++;
+			if(slot == aggregator->pending.size())
+				aggregator->pending.emplace_back();
+			aggregator->pending[slot].endpoint = endpoint;
+			aggregator->pending[slot].size = 0;
+			aggregator->index.Insert(endpoint, slot);
+		}
+		ArmAggregation();
+		Aggregator::Pending& pending = aggregator->pending[slot];
+		uint8_t* data = pending.data + pending.size;
+		pending.size += size;
+		return data;
+	}
+	
+	void Socket::FlushAggregated(const Endpoint* endpoint) {
+		if(!aggregator)
+			return;
+		if(endpoint) {
+			if(const uint32_t* slot = aggregator->index.Find(*endpoint)) {
+				Aggregator::Pending& pending = aggregator->pending[*slot];
+				if(pending.size)
+					SendDatagram(pending.endpoint, pending.data, pending.size);
+				pending.size = 0;
+			}
+			return;
+		}
+		for(uint32_t i=0; i<aggregator->used; ++i) {
+			Aggregator::Pending& pending = aggregator->pending[i];
+			if(pending.size)
+				SendDatagram(pending.endpoint, pending.data, pending.size);
+		}
+		aggregator->used = 0;
+		aggregator->index.Clear();
+	}
+	
+	void Socket::ArmAggregation() {
+		if(aggregator->timerArmed || context == NULL)
+			return;
+		if(!aggregator->timer)
+			aggregator->timer.reset(new boost::asio::steady_timer(*context));
+		aggregator->timerArmed = true;
+		++pendingHandlers;
+		aggregator->timer->expires_after(
+				std::chrono::milliseconds(aggregator->delayms));
+		aggregator->timer->async_wait(
+				[this](const boost::system::error_code& err) {
+					std::lock_guard<std::mutex> lock(ioEvent.mutex);
+					--pendingHandlers;
+					if(aggregator) {
+						aggregator->timerArmed = false;
+						if(err != boost::asio::error::operation_aborted)
+							FlushAggregated(NULL);
+					}
+					ioEvent.Notify();
+				});
+	}
+	
+	
+	size_t Socket::InternalDatagramSize(const Endpoint& endpoint) {
+		if(!pmtu)
+			return udpMessageSizeLimit;
+		const uint64_t id = peers.Find(endpoint);
+		if(id == 0)
+			return udpMessageSizeLimit;
+		const auto now = std::chrono::steady_clock::now();
+		if(PathMtu::Peer* peer = pmtu->peers.Find(id)) {
+			peer->used = now;
+			if(peer->next == PathMtu::TimePoint::max()) {
+				// sent to again after a pause, confirm before trusting it
+				peer->next = now;
+				ProbePeer(id, now);
+				ArmMtuProbe();
+			}
+			return peer->size;
+		}
+		PathMtu::Peer peer;
+		peer.size = udpMessageSizeLimit;
+		peer.low = udpMessageSizeLimit;
+		peer.high = udpMaxDatagramSize;
+		peer.probeSize = 0;
+		peer.probeId = 0;
+		peer.attempts = 0;
+		peer.searching = true;
+		peer.next = now;
+		peer.searched = now;
+		peer.used = now;
+		pmtu->peers.Insert(id, peer);
+		ProbePeer(id, now);
+		ArmMtuProbe();
+		return udpMessageSizeLimit;
+	}
+	
+	void Socket::ProbePeer(uint64_t id, PeerTable::TimePoint now) {
+		PathMtu::Peer* peer = pmtu->peers.Find(id);
+		const Endpoint* endpoint = peers.Find(id);
+		if(peer == NULL || endpoint == NULL || sock == NULL)
+			return;
+		while(peer->next <= now) {
+			if(peer->probeSize) {
+				if(++peer->attempts < udpMtuProbeAttempts) {
+					SendMtuProbe(*endpoint, id, now);
+					continue;
+				}
+				if(peer->searching) {
+					peer->high = peer->probeSize - 1;
+				} else {
+					// the confirmed size stopped passing, start over from
+					// the size every path takes
+					peer->size = udpMessageSizeLimit;
+					peer->low = udpMessageSizeLimit;
+					peer->high = udpMaxDatagramSize;
+					peer->searching = true;
+				}
+				peer->probeSize = 0;
+			}
+			if(peer->searching && peer->high-peer->low < mtuSearchGranularity) {
+				peer->searching = false;
+				peer->searched = now;
+				peer->next = now +
+					std::chrono::milliseconds(udpMtuConfirmIntervalms);
+			} else if(peer->searching) {
+				peer->probeSize = peer->low + (peer->high-peer->low+1)/2;
+				peer->probeId = pmtu->nextProbeId++;
+				peer->attempts = 0;
+				SendMtuProbe(*endpoint, id, now);
+			} else if(now - peer->used >=
+					std::chrono::milliseconds(udpMtuConfirmIntervalms)) {
+				// not sent to anymore, nothing to probe for
+				peer->next = PathMtu::TimePoint::max();
+			} else if(now - peer->searched >=
+					std::chrono::milliseconds(udpMtuRaiseIntervalms)) {
+				peer->searching = true;
+				peer->low = peer->size;
+				peer->high = udpMaxDatagramSize;
+			} else if(peer->size > udpMessageSizeLimit) {
+				peer->probeSize = peer->size;
+				peer->probeId = pmtu->nextProbeId++;
+				peer->attempts = 0;
+				SendMtuProbe(*endpoint, id, now);
+			} else {
+				peer->next = peer->searched +
+					std::chrono::milliseconds(udpMtuRaiseIntervalms);
+			}
+		}
+	}
+	
+	void Socket::SendMtuProbe(const Endpoint& endpoint, uint64_t id,
+			PeerTable::TimePoint now) {
+		PathMtu::Peer* peer = pmtu->peers.Find(id);
+		peer->next = now + std::chrono::milliseconds(udpMtuProbeTimeoutms);
+		std::vector<uint8_t>& probe = pmtu->probe;
+		probe.assign(peer->probeSize, 0);
+		probe[1] = mtuProbe;
+		Put32(probe.data()+2, peer->probeId);
+		// sent past the batch queue, a refused probe has to be seen here
+		boost::system::error_code err;
+		sock->send_to(boost::asio::buffer(probe), endpoint.UdpEndpoint(), 0,
+				err);
+		if(err == boost::asio::error::message_size) {
+			// larger than the local link takes, no need to wait for it
+			peer->attempts = udpMtuProbeAttempts;
+			peer->next = now;
+		}
+	}
+	
+	void Socket::AnswerMtuProbe(const Endpoint& endpoint, const uint8_t* data,
+			size_t size) {
+		// Probes skip the cookie gate, so only datagrams larger than any
+		// probe answer are answered and a spoofed source gains nothing.
+		// Real probes always test sizes above udpMessageSizeLimit.
+		if(size < udpMessageSizeLimit)
+			return;
+		uint8_t ack[mtuAckSize];
+		ack[0] = 0;
+		ack[1] = mtuAck;
+		memcpy(ack+2, data+2, 4);
+		Put32(ack+6, size);
+		SendDatagram(endpoint, ack, mtuAckSize);
+	}
+	
+	void Socket::ReceiveMtuAck(uint64_t id, const uint8_t* data, size_t size) {
+		if(!pmtu || size != mtuAckSize)
+			return;
+		PathMtu::Peer* peer = pmtu->peers.Find(id);
+		if(peer == NULL || peer->probeSize == 0 ||
+				Get32(data+2) != peer->probeId ||
+				Get32(data+6) != peer->probeSize)
+			return;
+		const auto now = std::chrono::steady_clock::now();
+		if(peer->searching) {
+			peer->low = peer->probeSize;
+			peer->size = peer->probeSize;
+			peer->next = now;
+		} else {
+			peer->next = now +
+				std::chrono::milliseconds(udpMtuConfirmIntervalms);
+		}
+		peer->probeSize = 0;
+		ProbePeer(id, now);
+		ArmMtuProbe();
+	}
+	
+	void Socket::ArmMtuProbe() {
+		if(context == NULL)
+			return;
+		auto deadline = PathMtu::TimePoint::max();
+		pmtu->peers.ForEach([&](uint64_t, const PathMtu::Peer& peer) {
+				deadline = std::min(deadline, peer.next);
+			});
+		if(deadline == PathMtu::TimePoint::max() ||
+				(pmtu->timerArmed && pmtu->timerDeadline <= deadline))
+			return;
+		if(!pmtu->timer)
+			pmtu->timer.reset(new boost::asio::steady_timer(*context));
+		// moving the expiry aborts the wait armed before, whose handler
+		// leaves timerArmed to this one
+		pmtu->timerArmed = true;
+		pmtu->timerDeadline = deadline;
+		++pendingHandlers;
+		pmtu->timer->expires_at(deadline);
+		pmtu->timer->async_wait([this](const boost::system::error_code& err) {
+				std::lock_guard<std::mutex> lock(ioEvent.mutex);
+				--pendingHandlers;
+				if(pmtu && err != boost::asio::error::operation_aborted) {
+					pmtu->timerArmed = false;
+					ProbeMtu();
+				}
+				ioEvent.Notify();
+			});
+	}
+	
+	void Socket::ProbeMtu() {
+		const auto now = std::chrono::steady_clock::now();
+		pmtu->due.clear();
+		pmtu->peers.ForEach([&](uint64_t id, const PathMtu::Peer& peer) {
+				if(peer.next <= now)
+					pmtu->due.emplace_back(id);
+			});
+		for(uint64_t id : pmtu->due)
+			ProbePeer(id, now);
+		ArmMtuProbe();
+	}
+	
+	
+	bool Socket::SendReliable(const Message& message,
+			const GlobalEndpoint& endpoint) {
+		return SendReliable(message, Endpoint(endpoint));
+	}
+	
+	bool Socket::SendReliable(const Message& message, const Endpoint& endpoint) {
+		return SendReliable(message, GetId(endpoint));
+	}
+	
+	bool Socket::SendReliable(const Message& message, uint64_t id) {
+		std::vector<uint8_t> frame;
+		CreateOptimalBuffer(message, frame);
+		if(frame.size() > udpMaxMessageSize)
+			return false;
+		
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		if(sock == NULL || peers.Find(id) == NULL)
+			return false;
+		ReliableChannel& channel = InternalChannel(id);
+		if(frame.size()+reliableHeaderSize <= udpMessageSizeLimit) {
+			std::vector<uint8_t> datagram(reliableHeaderSize);
+			datagram.insert(datagram.end(), frame.begin(), frame.end());
+			channel.backlog.emplace_back(std::move(datagram));
+		} else {
+			for(size_t offset=0; offset<frame.size();
+					offset+=reliableChunkSize) {
+				const size_t length = std::min(reliableChunkSize,
+						frame.size()-offset);
+				std::vector<uint8_t> datagram(reliableHeaderSize +
+						reliableChunkHeaderSize + length);
+				datagram[reliableHeaderSize] = 0;
+				datagram[reliableHeaderSize+1] =
+					offset+length < frame.size();
+				memcpy(&datagram[reliableHeaderSize+reliableChunkHeaderSize],
+						frame.data()+offset, length);
+				channel.backlog.emplace_back(std::move(datagram));
+			}
+		}
+		TransmitReliable(channel);
+		return true;
+	}
+	
+	
+	ReliableChannel& Socket::InternalChannel(uint64_t id) {
+		if(ReliableChannel** channel = reliable->channels.Find(id))
+			return **channel;
+		ReliableChannel* channel = new ReliableChannel(*peers.Find(id));
+		reliable->channels.Insert(id, channel);
+		return *channel;
+	}
+	
+	void Socket::TransmitReliable(ReliableChannel& channel) {
+		const auto now = std::chrono::steady_clock::now();
+		while(!channel.backlog.empty()) {
+			const uint64_t oldest = channel.unacked.empty() ?
+				channel.nextSequence : channel.unacked.begin()->first;
+			if(channel.nextSequence - oldest >= reliableWindow ||
+					channel.unacked.size() >= channel.cwnd)
+				break;
+			const uint64_t sequence = channel.nextSequence++;
+			ReliableChannel::Pending& pending = channel.unacked[sequence];
+			pending.datagram.swap(channel.backlog.front());
+			channel.backlog.pop_front();
+			pending.datagram[0] = 0;
+			pending.datagram[1] = reliableData;
+			Put32(&pending.datagram[2], sequence);
+			pending.sentAt = now;
+			pending.transmissions = 1;
+			WriteReliableAck(channel, pending.datagram.data());
+			SendDatagram(channel.endpoint, pending.datagram.data(),
+					pending.datagram.size());
+		}
+		ArmRetransmission();
+	}
+	
+	void Socket::ReceiveReliable(uint64_t id, const uint8_t* data,
+			size_t size) {
+		if(size < reliableHeaderSize || reliable == NULL)
+			return;
+		ReliableChannel& channel = InternalChannel(id);
+		AcknowledgeReliable(channel, Get32(data+6), Get32(data+10));
+		if(data[1] != reliableData)
+			return;
+		
+		const uint64_t sequence = ExtendSequence(channel.expected,
+				Get32(data+2));
+		// duplicates are acknowledged again, the previous ack may be lost
+		if(!channel.ackPending) {
+			channel.ackPending = true;
+			reliable->acksPending.emplace_back(id);
+		}
+		if(sequence < channel.expected ||
+				sequence >= channel.expected+reliableWindow)
+			return;
+		if(sequence != channel.expected) {
+			channel.outOfOrder.emplace(sequence, std::vector<uint8_t>(
+						data+reliableHeaderSize, data+size));
+			return;
+		}
+		DeliverReliable(id, channel, data+reliableHeaderSize,
+				size-reliableHeaderSize);
+		++channel.expected;
+		for(auto it=channel.outOfOrder.begin();
+				it!=channel.outOfOrder.end() && it->first==channel.expected;
+				it=channel.outOfOrder.erase(it)) {
+			DeliverReliable(id, channel, it->second.data(),
+					it->second.size());
+			++channel.expected;
+		}
+	}
+	
+	void Socket::DeliverReliable(uint64_t id, ReliableChannel& channel,
+			const uint8_t* data, size_t size) {
+		if(size == 0 || data[0] != 0) {
+			QueueFrame(id, data, size);
+			return;
+		}
+		if(size < reliableChunkHeaderSize)
+			return;
+		const size_t length = size - reliableChunkHeaderSize;
+		if(channel.partial.size()+length > udpMaxMessageSize) {
+			channel.partial.clear();
+			channel.partialDropped = true;
+		} else if(!channel.partialDropped) {
+			channel.partial.insert(channel.partial.end(),
+					data+reliableChunkHeaderSize, data+size);
+		}
+		if(data[1] == 0) {
+			if(!channel.partialDropped)
+				QueueFrame(id, channel.partial.data(), channel.partial.size());
+			channel.partial.clear();
+			channel.partialDropped = false;
+		}
+	}
+	
+	void Socket::AcknowledgeReliable(ReliableChannel& channel, uint32_t ack,
+			uint32_t bits) {
+		const uint64_t cumulative = ExtendSequence(channel.nextSequence, ack);
+		if(cumulative > channel.nextSequence)
+			return;
+		const auto now = std::chrono::steady_clock::now();
+		auto acknowledged = [&](std::map<uint64_t,
+				ReliableChannel::Pending>::iterator it) {
+			if(it->second.transmissions == 1) {
+				// Karn: only messages sent once give unambiguous samples
+				const double rtt = std::chrono::duration<double, std::milli>(
+						now - it->second.sentAt).count();
+				if(channel.hasRtt) {
+					channel.rttvarms = 0.75*channel.rttvarms +
+						0.25*std::abs(channel.srttms - rtt);
+					channel.srttms = 0.875*channel.srttms + 0.125*rtt;
+				} else {
+					channel.srttms = rtt;
+					channel.rttvarms = rtt/2;
+					channel.hasRtt = true;
+				}
+				channel.rtoms = std::clamp((int)(channel.srttms +
+							4*channel.rttvarms + 0.5),
+						reliableMinRtoms, reliableMaxRtoms);
+			}
+			channel.Acknowledged();
+			return channel.unacked.erase(it);
+		};
+		for(auto it=channel.unacked.begin(); it!=channel.unacked.end() &&
+				it->first<cumulative;)
+			it = acknowledged(it);
+		uint64_t highest = 0;
+		for(uint32_t i=0; i<32; ++i) {
+			if(bits & (1u<<i)) {
+				highest = cumulative+1+i;
+				auto it = channel.unacked.find(highest);
+				if(it != channel.unacked.end())
+					acknowledged(it);
+			}
+		}
+		// fast retransmit: the peer already holds later messages, so
+		// everything older that is out for longer than srtt is lost
+		if(highest && channel.hasRtt) {
+			const auto srtt = std::chrono::duration<double, std::milli>(
+					channel.srttms);
+			uint32_t resent = 0;
+			for(auto it=channel.unacked.begin(); it!=channel.unacked.end() &&
+					it->first<highest && resent<channel.cwnd; ++it) {
+				ReliableChannel::Pending& pending = it->second;
+				if(now - pending.sentAt < srtt)
+					continue;
+				if(resent++ == 0)
+					channel.Lost(it->first);
+				++pending.transmissions;
+				pending.sentAt = now;
+				WriteReliableAck(channel, pending.datagram.data());
+				SendDatagram(channel.endpoint, pending.datagram.data(),
+						pending.datagram.size());
+			}
+		}
+		if(!channel.backlog.empty())
+			TransmitReliable(channel);
 	}
 	
-	Endpoint::Endpoint() {
-		ref = false;
-		ptr = new boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), 0);
+	void Socket::SendReliableAcks() {
+		if(reliable == NULL)
+			return;
+		for(uint64_t id : reliable->acksPending) {
+			ReliableChannel** found = reliable->channels.Find(id);
+			if(found == NULL || !(*found)->ackPending)
+				continue;
+			ReliableChannel& channel = **found;
+			uint8_t datagram[reliableHeaderSize];
+			datagram[0] = 0;
+			datagram[1] = reliableAck;
+			Put32(datagram+2, 0);
+			WriteReliableAck(channel, datagram);
+			SendDatagram(channel.endpoint, datagram, reliableHeaderSize);
+		}
+		reliable->acksPending.clear();
 	}
 	
-	Endpoint::Endpoint(const GlobalEndpoint& endpoint) {
-		ref = false;
-		ptr = new boost::asio::ip::udp::endpoint(endpoint.UdpEndpoint());
+	void Socket::ArmRetransmission() {
+		if(reliable == NULL || reliable->timerArmed || sock == NULL)
+			return;
+		auto deadline = std::chrono::steady_clock::time_point::max();
+		reliable->channels.ForEach([&](uint64_t, ReliableChannel* channel) {
+				for(const auto& it : channel->unacked)
+					deadline = std::min(deadline, it.second.sentAt +
+							std::chrono::milliseconds(channel->rtoms));
+			});
+		if(deadline == std::chrono::steady_clock::time_point::max())
+			return;
+		reliable->timerArmed = true;
+		++pendingHandlers;
+		reliable->timer.expires_at(deadline);
+		reliable->timer.async_wait([this](const boost::system::error_code& err) {
+				std::lock_guard<std::mutex> lock(ioEvent.mutex);
+				--pendingHandlers;
+				if(reliable) {
+					reliable->timerArmed = false;
+					if(err != boost::asio::error::operation_aborted)
+						Retransmit();
+				}
+				ioEvent.Notify();
+			});
 	}
 	
-	Endpoint::Endpoint(const Endpoint& endpoint) {
-		ref = false;
-		ptr = new boost::asio::ip::udp::endpoint(*endpoint.ptr);
+	void Socket::Retransmit() {
+		const auto now = std::chrono::steady_clock::now();
+		std::vector<uint64_t> lost;
+		reliable->channels.ForEach([&](uint64_t id, ReliableChannel* channel) {
+				if(channel->unacked.empty())
+					return;
+				const auto rto = std::chrono::milliseconds(channel->rtoms);
+				auto oldest = channel->unacked.begin();
+				if(oldest->second.sentAt + rto <= now) {
+					if(oldest->second.transmissions >=
+							reliableMaxTransmissions) {
+						lost.emplace_back(id);
+						return;
+					}
+					// back off once per timeout of the oldest message, not
+					// for every message that was in flight with it
+					channel->Lost(oldest->first);
+					channel->rtoms = std::min(channel->rtoms*2,
+							reliableMaxRtoms);
+				}
+				// resending everything that expired at once would only
+				// overflow the path again, the rest waits for another rto
+				uint32_t resent = 0;
+				for(auto& it : channel->unacked) {
+					ReliableChannel::Pending& pending = it.second;
+					if(pending.sentAt + rto > now)
+						continue;
+					pending.sentAt = now;
+					if(resent >= channel->cwnd ||
+							pending.transmissions >= reliableMaxTransmissions)
+						continue;
+					++resent;
+					++pending.transmissions;
+					WriteReliableAck(*channel, pending.datagram.data());
+					SendDatagram(channel->endpoint, pending.datagram.data(),
+							pending.datagram.size());
+				}
+			});
+		for(uint64_t id : lost) {
+			ReliableChannel** channel = reliable->channels.Find(id);
+			fprintf(stderr, "\n Reliable UDP peer %llu stopped acknowledging,"
+					" closing it, %llu messages dropped",
+					(unsigned long long)id,
+					(unsigned long long)((*channel)->unacked.size() +
+						(*channel)->backlog.size()));
+			// The peer still expects the next sequence number, a new
+			// channel starting from zero would never be delivered there, so
+			// the whole peer is closed and reported as evicted.
+			EvictPeer(id);
+		}
+		ArmRetransmission();
 	}
 	
-	Endpoint::Endpoint(uint16_t port) {
-		ref = false;
-		ptr = new boost::asio::ip::udp::endpoint(
-				boost::asio::ip::udp::v4(),
-				port);
-	}
 	
-	Endpoint::~Endpoint() {
-		if(!ref && ptr)
-			delete ptr;
+	uint8_t* Socket::QueueDatagram(const Endpoint& endpoint, size_t size) {
+		BatchIo::SendQueue& fill = batch->fill;
+		if(fill.queued >= batch->size)
+			FlushSendQueue();
+		if(fill.queued == fill.sizes.size()) {
+			// the other queue is still being sent, this one takes up to a
+			// whole fragmented message more and is dropped after that
+			if(fill.queued >= batch->size + maxFragments) {
+				fill.queued = 0;
+			} else {
+				const uint32_t slots = fill.queued + batch->size;
+				fill.slab.resize(slots*udpMaxDatagramSize);
+				fill.sizes.resize(slots);
+				fill.endpoints.resize(slots);
+			}
+		}
+		const uint32_t slot = fill.queued++;
+		fill.sizes[slot] = size;
+		fill.endpoints[slot] = endpoint.UdpEndpoint();
+		return fill.slab.data() + slot*udpMaxDatagramSize;
 	}
 	
-	
-	Endpoint Endpoint::MakeEmpty() {
-		return Endpoint(true);
+	void Socket::DatagramQueued() {
+		if(batch->fill.queued >= batch->size) {
+			FlushSendQueue();
+		} else if(!flushScheduled) {
+			// everything queued until the io context gets to it goes out
+			// in one sendmmsg
+			flushScheduled = true;
+			++pendingHandlers;
+			boost::asio::post(*context, [this]() {
+					std::lock_guard<std::mutex> lock(ioEvent.mutex);
+					--pendingHandlers;
+					flushScheduled = false;
+					FlushSendQueue();
+					ioEvent.Notify();
+				});
+		}
 	}
 	
-	Endpoint Endpoint::Make(boost::asio::ip::udp::endpoint* ptr) {
-		return Endpoint(true, ptr);
+	void Socket::FlushSendQueue() {
+		if(!batch || batch->fill.queued == 0 || batch->send.queued)
+			return;
+		if(sock == NULL) {
+			batch->fill.queued = 0;
+			return;
+		}
+		// the filled queue is handed to the io thread, datagrams queued
+		// meanwhile go to the other one
+		std::swap(batch->fill, batch->send);
+		batch->sendFirstUnsent = 0;
+		// the socket is written only by the io thread, as Close does
+		RunOnIoThread(context, ioEvent, pendingHandlers, [this]() {
+				SendQueued();
+			});
 	}
 	
-	
-	Endpoint& Endpoint::operator = (const Endpoint& other) {
-		if(!ref && ptr)
-			delete ptr;
-		ref = false;
-		ptr = new boost::asio::ip::udp::endpoint(*other.ptr);
-		return *this;
-	}
-	bool Endpoint::operator < (const Endpoint& r) const {
-		if(ptr && r.ptr)
-			return (*ptr) < (*r.ptr);
-		if(ptr==NULL && r.ptr==NULL)
-			return false;
-		return ptr==NULL && r.ptr;
-	}
-	bool Endpoint::operator == (const Endpoint& r) const {
-		if(ptr && r.ptr)
-			return (*ptr) == (*r.ptr);
-		if(ptr==NULL && r.ptr==NULL)
-			return true;
-		return false;
-	}
-	bool Endpoint::operator != (const Endpoint& r) const {
-		if(ptr && r.ptr)
-			return (*ptr) != (*r.ptr);
-		if(ptr==NULL && r.ptr==NULL)
-			return false;
-		return true;
+	void Socket::SendQueued() {
+		if(!batch || batch->send.queued == 0)
+			return;
+		BatchIo::SendQueue& send = batch->send;
+		if(sock == NULL || !sock->is_open()) {
+			send.queued = 0;
+			return;
+		}
+		const uint32_t queued = send.queued;
+#ifdef __linux__
+		if(batch->sendHeaders.size() < queued) {
+			batch->sendHeaders.resize(queued);
+			batch->sendIovecs.resize(queued);
+			batch->sendFirst.resize(queued);
+			batch->sendControl.resize(queued*CMSG_SPACE(sizeof(uint16_t)));
+		}
+		for(uint32_t i=batch->sendFirstUnsent; i<queued; ++i) {
+			batch->sendIovecs[i].iov_base =
+				send.slab.data() + i*udpMaxDatagramSize;
+			batch->sendIovecs[i].iov_len = send.sizes[i];
+		}
+		const uint32_t* sizes = send.sizes.data();
+		const boost::asio::ip::udp::endpoint* endpoints = send.endpoints.data();
+		const bool gso = offload && offload->gso;
+		uint32_t messages = 0;
+		for(uint32_t i=batch->sendFirstUnsent; i<queued; ++messages) {
+			// with GSO, consecutive datagrams of one size to one endpoint
+			// go out as one message, the last of them may be shorter
+			uint32_t run = 1;
+			size_t total = sizes[i];
+			while(gso && sizes[i] > 0 && i+run < queued &&
+					run < offloadMaxSegments &&
+					sizes[i+run-1] == sizes[i] &&
+					sizes[i+run] <= sizes[i] &&
+					total+sizes[i+run] <= offloadMaxBytes &&
+					endpoints[i+run] == endpoints[i])
+				total += sizes[i+run++];
+			msghdr& header = batch->sendHeaders[messages].msg_hdr;
+			header.msg_name = (void*)endpoints[i].data();
+			header.msg_namelen = endpoints[i].size();
+			header.msg_iov = &batch->sendIovecs[i];
+			header.msg_iovlen = run;
+			header.msg_control = NULL;
+			header.msg_controllen = 0;
+#ifdef UDP_SEGMENT
+			if(run > 1)
+				SetSegmentSize(header, batch->sendControl.data() +
+						messages*CMSG_SPACE(sizeof(uint16_t)), sizes[i]);
+#endif
+			batch->sendFirst[messages] = i;
+			i += run;
+		}
+		uint32_t sent = 0;
+		while(sent < messages) {
+			int ret = sendmmsg(sock->native_handle(),
+					batch->sendHeaders.data()+sent, messages-sent, 0);
+			if(ret > 0) {
+				sent += ret;
+			} else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				batch->sendFirstUnsent = batch->sendFirst[sent];
+				WaitWritable();
+				return;
+			} else if(errno != EINTR) {
+				msghdr& header = batch->sendHeaders[sent].msg_hdr;
+				if(header.msg_iovlen > 1 && (errno == EIO ||
+							errno == EINVAL || errno == EOPNOTSUPP)) {
+					// segmentation refused, the run goes out datagram by
+					// datagram and later flushes do not try again
+					offload->gso = false;
+					const uint32_t first = batch->sendFirst[sent];
+					for(uint32_t j=0; j<header.msg_iovlen; ++j) {
+						boost::system::error_code err;
+						sock->send_to(boost::asio::buffer(
+									batch->sendIovecs[first+j].iov_base,
+									batch->sendIovecs[first+j].iov_len),
+								endpoints[first], 0, err);
+					}
+				} else {
+					// like a failed send_to, the datagram is lost
+					fprintf(stderr, "\n Error while sending: %s",
+							strerror(errno));
+				}
+				++sent;
+			}
+		}
+#else
+		for(uint32_t i=batch->sendFirstUnsent; i<queued; ++i) {
+			boost::system::error_code err;
+			sock->send_to(boost::asio::buffer(
+						send.slab.data() + i*udpMaxDatagramSize,
+						send.sizes[i]),
+					send.endpoints[i], 0, err);
+			if(err == boost::asio::error::would_block) {
+				batch->sendFirstUnsent = i;
+				WaitWritable();
+				return;
+			}
+		}
+#endif
+		send.queued = 0;
+		// queued while this one was sent
+		FlushSendQueue();
 	}
 	
-	Endpoint::operator GlobalEndpoint() const {
-		if(ptr)
-			return GlobalEndpoint(*ptr);
-		return GlobalEndpoint();
+	void Socket::WaitWritable() {
+		// the unsent datagrams wait for the socket buffer instead of
+		// blocking with the socket locked
+		++pendingHandlers;
+		sock->async_wait(boost::asio::ip::udp::socket::wait_write,
+				[this](const boost::system::error_code& err) {
+					std::lock_guard<std::mutex> lock(ioEvent.mutex);
+					--pendingHandlers;
+					if(batch && batch->send.queued) {
+						if(err)
+							batch->send.queued = 0;
+						else
+							SendQueued();
+					}
+					ioEvent.Notify();
+				});
 	}
 	
 	
-	
-	Socket::Socket() {
-		nextEmptyId = 1;
-		sock = NULL;
+	void Socket::ReceiveDatagram(const Endpoint& endpoint, uint8_t* data,
+			size_t size) {
+		if(size > 1 && data[0] == 0 && data[1] == cookieChallenge) {
+			EchoCookie(endpoint, data, size);
+			return;
+		}
+		if(size > 1 && data[0] == 0 && data[1] == mtuProbe) {
+			AnswerMtuProbe(endpoint, data, size);
+			return;
+		}
+		const auto now = std::chrono::steady_clock::now();
+		uint64_t id = peers.Touch(endpoint, now);
+		if(id == 0) {
+			if(cookies && !PassCookieGate(endpoint, data, size))
+				return;
+			id = InternalPopNextEmptyId();
+			peers.Insert(endpoint, id, now);
+		}
+		EvictPeers(now, id);
+		// a leading zero byte marks a control datagram, one of an unknown
+		// type is dropped rather than taken for reliable acks
+		if(size > 1 && data[0] == 0 && data[1] == fragmentData)
+			ReceiveFragment(id, data, size);
+		else if(size > 1 && data[0] == 0 && data[1] == cookieEcho)
+			return;
+		else if(size > 1 && data[0] == 0 && data[1] == mtuAck)
+			ReceiveMtuAck(id, data, size);
+		else if(size > 1 && data[0] == 0 && (data[1] == reliableData ||
+					data[1] == reliableAck))
+			ReceiveReliable(id, data, size);
+		else if(size == 0 || data[0] != 0)
+			QueueFrame(id, data, size);
 	}
 	
-	Socket::~Socket() {
-		Close();
+	bool Socket::PassCookieGate(const Endpoint& endpoint, const uint8_t* data,
+			size_t size) {
+		if(size == cookieDatagramSize && data[0] == 0 && data[1] == cookieEcho)
+			return cookies->Verify(endpoint, data+2);
+		if(size >= cookieDatagramSize) {
+			uint8_t challenge[cookieDatagramSize];
+			challenge[0] = 0;
+			challenge[1] = cookieChallenge;
+			cookies->Make(endpoint, CookieGate::Slot(), challenge+2);
+			SendDatagram(endpoint, challenge, cookieDatagramSize);
+		}
+		return false;
 	}
 	
-	void Socket::Open(const GlobalEndpoint& endpoint) {
-		Close();
-		Endpoint end(endpoint);
-		sock = new boost::asio::ip::udp::socket(IoContext(), *end.ptr);
+	void Socket::EchoCookie(const Endpoint& endpoint, const uint8_t* data,
+			size_t size) {
+		if(size != cookieDatagramSize)
+			return;
+		uint8_t echo[cookieDatagramSize];
+		memcpy(echo, data, cookieDatagramSize);
+		echo[1] = cookieEcho;
+		SendDatagram(endpoint, echo, cookieDatagramSize);
 	}
 	
-	void Socket::Close() {
-		if(sock) {
-			sock->close();
-			delete sock;
-			sock = NULL;
-		}
-		endpointId.clear();
-		received.clear();
-		nextEmptyId = 1;
+	void Socket::ReceiveFragment(uint64_t id, const uint8_t* data,
+			size_t size) {
+		if(size <= fragmentHeaderSize)
+			return;
+		if(!reassembler)
+			reassembler.reset(new Reassembler());
+		const std::vector<uint8_t>* frame = reassembler->Add(id,
+				Get32(data+2), Get16(data+6), Get16(data+8),
+				data+fragmentHeaderSize, size-fragmentHeaderSize);
+		if(frame)
+			QueueFrame(id, frame->data(), frame->size());
 	}
 	
-	
-	bool Socket::Send(const std::vector<uint8_t>& buffer,
-			const Endpoint& endpoint) {
-		if(sock!=NULL && buffer.size()<=udpMessageSizeLimit) {
-			boost::system::error_code err;
-			sock->send_to(boost::asio::buffer(buffer), *endpoint.ptr, 0, err);
-			if(err)
-				return false;
-			return true;
+	void Socket::QueueFrame(uint64_t id, const uint8_t* data, size_t size) {
+		// aggregated datagrams carry more frames after the first one
+		FrameParser parser;
+		size_t offset = 0;
+		while(offset < size) {
+			const size_t used = parser.Feed(data+offset, size-offset);
+			if(parser.GetState() != FrameParser::complete)
+				break;
+			ReadParsedMessage(inbox.Push(id), data+offset, parser);
+			offset += used;
+			parser.Reset();
 		}
-		return false;
-	}
-	bool Socket::Send(const std::vector<uint8_t>& buffer, uint64_t id) {
-		if(endpointId.has(id)) {
-			const Endpoint& endpoint = endpointId[id];
-			return Send(buffer, endpoint);
+		if(offset == 0) {
+			Message& message = inbox.Push(id);
+			message.title.clear();
+			message.data.clear();
 		}
-		return false;
-	}
-	bool Socket::Send(const std::vector<uint8_t>& buffer,
-			const GlobalEndpoint& endpoint) {
-		Endpoint end(endpoint);
-		return Send(buffer, end);
-	}
-	bool Socket::Send(const Message& message, const GlobalEndpoint& endpoint) {
-		std::vector<uint8_t> buffer;
-		CreateOptimalBuffer(message, buffer);
-		return Send(buffer, endpoint);
-	}
-	bool Socket::Send(const Message& message, const Endpoint& endpoint) {
-		std::vector<uint8_t> buffer;
-		CreateOptimalBuffer(message, buffer);
-		return Send(buffer, endpoint);
 	}
-	bool Socket::Send(const Message& message, uint64_t id) {
-		if(endpointId.has(id)) {
-			const Endpoint& endpoint = endpointId[id];
-			return Send(message, endpoint);
+	
+	void Socket::FetchData() {
+		if(context && !IsIoThreadContext(context)) {
+			if(context->stopped())
+				context->restart();
+			context->poll();
 		}
-		return false;
 	}
 	
-	
-	void Socket::FetchData() {
-		if(sock) {
-			Endpoint endpoint;
+	void Socket::ReceivePending() {
+		if(sock && sock->is_open()) {
+#ifdef __linux__
+			if(offload && offload->gro) {
+				FetchOffload();
+				return;
+			}
+			if(batch) {
+				FetchBatch();
+				return;
+			}
+#endif
+			boost::asio::ip::udp::endpoint from;
 			boost::system::error_code err;
 			while(sock->available()>0) {
 				size_t recvd = sock->receive_from(
 						boost::asio::buffer(
 							recvTempBuffer,
-							udpMessageSizeLimit),
-						*endpoint.ptr,
+							udpMaxDatagramSize),
+						from,
 						0, err);
 				if(!err) {
-					uint64_t id = GetId(endpoint);
-					std::queue<Message>& msgs = received[id];
-					msgs.emplace();
-					size_t readed = TryReadMessageFromBuffer(
-						msgs.back(), recvTempBuffer, recvd);
+					ReceiveDatagram(from, recvTempBuffer, recvd);
 				} else {
-					fprintf(stderr, "\n Error while receiving: %i", err);
+					fprintf(stderr, "\n Error while receiving: %s",
+							err.message().c_str());
+				}
+			}
+		}
+	}
+	
+	void Socket::FetchBatch() {
+#ifdef __linux__
+		boost::asio::ip::udp::endpoint from;
+		for(;;) {
+			for(uint32_t i=0; i<batch->size; ++i) {
+				batch->recvHeaders[i].msg_hdr.msg_namelen =
+					sizeof(sockaddr_storage);
+				batch->recvHeaders[i].msg_hdr.msg_flags = 0;
+			}
+			int ret = recvmmsg(sock->native_handle(),
+					batch->recvHeaders.data(), batch->size, MSG_DONTWAIT,
+					NULL);
+			if(ret < 0) {
+				if(errno == EINTR || errno == ECONNREFUSED)
+					continue;
+				if(errno != EAGAIN && errno != EWOULDBLOCK)
+					fprintf(stderr, "\n Error while receiving: %s",
+							strerror(errno));
+				return;
+			}
+			for(int i=0; i<ret; ++i) {
+				const msghdr& header = batch->recvHeaders[i].msg_hdr;
+				memcpy(from.data(), header.msg_name, header.msg_namelen);
+				from.resize(header.msg_namelen);
+				ReceiveDatagram(from,
+						batch->recvSlab.data() + i*udpMaxDatagramSize,
+						batch->recvHeaders[i].msg_len);
+			}
+			if((uint32_t)ret < batch->size)
+				return;
+		}
+#endif
+	}
+	
+	void Socket::FetchOffload() {
+#ifdef UDP_GRO
+		boost::asio::ip::udp::endpoint from;
+		uint8_t* data = offload->recvBuffer.data();
+		uint8_t control[CMSG_SPACE(sizeof(int))];
+		for(;;) {
+			sockaddr_storage address;
+			iovec iov;
+			iov.iov_base = data;
+			iov.iov_len = offload->recvBuffer.size();
+			msghdr header;
+			memset(&header, 0, sizeof(header));
+			header.msg_name = &address;
+			header.msg_namelen = sizeof(address);
+			header.msg_iov = &iov;
+			header.msg_iovlen = 1;
+			header.msg_control = control;
+			header.msg_controllen = sizeof(control);
+			const ssize_t ret = recvmsg(sock->native_handle(), &header,
+					MSG_DONTWAIT);
+			if(ret < 0) {
+				if(errno == EINTR || errno == ECONNREFUSED)
+					continue;
+				if(errno != EAGAIN && errno != EWOULDBLOCK)
+					fprintf(stderr, "\n Error while receiving: %s",
+							strerror(errno));
+				return;
+			}
+			// without the control message the buffer is one datagram
+			size_t segment = ret;
+			for(cmsghdr* cmsg=CMSG_FIRSTHDR(&header); cmsg!=NULL;
+					cmsg=CMSG_NXTHDR(&header, cmsg)) {
+				if(cmsg->cmsg_level == IPPROTO_UDP &&
+						cmsg->cmsg_type == UDP_GRO) {
+					int size;
+					memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+					if(size > 0)
+						segment = size;
 				}
 			}
+			memcpy(from.data(), &address, header.msg_namelen);
+			from.resize(header.msg_namelen);
+			const Endpoint endpoint(from);
+			for(size_t offset=0; offset<(size_t)ret; offset+=segment)
+				ReceiveDatagram(endpoint, data+offset,
+						std::min(segment, ret-offset));
+		}
+#endif
+	}
+	
+	void Socket::StartReceive() {
+		if(sock == NULL || !sock->is_open())
+			return;
+		++pendingHandlers;
+		if(batch || (offload && offload->gro)) {
+			sock->async_wait(boost::asio::ip::udp::socket::wait_read,
+					[this](const boost::system::error_code& err) {
+						std::lock_guard<std::mutex> lock(ioEvent.mutex);
+						--pendingHandlers;
+						if(err == boost::asio::error::operation_aborted) {
+							ioEvent.Notify();
+						} else if(err) {
+							fprintf(stderr, "\n Waiting for UDP datagrams"
+									" failed: %s", err.message().c_str());
+							BackOffReceive();
+						} else {
+							if(receiveBackoff)
+								receiveBackoff->delayms = 0;
+							ReceiveCompleted();
+						}
+					});
+		} else {
+			sock->async_receive_from(
+					boost::asio::buffer(recvTempBuffer, udpMaxDatagramSize),
+					*recvEndpoint,
+					[this](const boost::system::error_code& err,
+						size_t size) {
+						std::lock_guard<std::mutex> lock(ioEvent.mutex);
+						--pendingHandlers;
+						if(!err)
+							ReceiveDatagram(*recvEndpoint, recvTempBuffer,
+									size);
+						ReceiveCompleted();
+					});
 		}
 	}
 	
+	void Socket::BackOffReceive() {
+		if(!receiveBackoff)
+			receiveBackoff.reset(new ReceiveBackoff(*context));
+		int& delayms = receiveBackoff->delayms;
+		delayms = delayms ? std::min(delayms*2, receiveBackoffMaxms) : 1;
+		++pendingHandlers;
+		receiveBackoff->timer.expires_after(std::chrono::milliseconds(delayms));
+		receiveBackoff->timer.async_wait(
+				[this](const boost::system::error_code& err) {
+					std::lock_guard<std::mutex> lock(ioEvent.mutex);
+					--pendingHandlers;
+					if(!err)
+						StartReceive();
+					ioEvent.Notify();
+				});
+	}
+	
+	void Socket::ReceiveCompleted() {
+		// whatever arrived meanwhile is taken now, before the next receive is
+		// armed, so datagrams are queued in arrival order
+		ReceivePending();
+		SendReliableAcks();
+		StartReceive();
+		ioEvent.Notify();
+		if(owner && !inbox.Empty())
+			owner->MessageArrived();
+	}
+	
 	bool Socket::HasAnyMessage() const {
-		for(const auto& it : received)
-			return !it.second.empty();
-		return false;
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		return InternalHasMessage(0);
 	}
 	
 	bool Socket::HasMessage(uint64_t id) {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		return InternalHasMessage(id);
+	}
+	
+	bool Socket::InternalHasMessage(uint64_t id) const {
 		if(id == 0)
-			return HasAnyMessage();
-		auto it = received.find(id);
-		if(it != received.end())
-			return !it->second.empty();
-		return false;
+			return !inbox.Empty();
+		return inbox.Has(id);
+	}
+	
+	void Socket::SetFairness(bool roundRobin) {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		inbox.SetFair(roundRobin);
 	}
 	
 	
 	bool Socket::InternalPopMessage(Message& message,
 			uint64_t& id, // when id=0 => pop any message
 			int timeoutms) {
-		FetchData();
-		if(timeoutms > 0) {
-			int end = clock() + timeoutms;
-			while(!HasMessage(id) && end>clock()) {
-				std::this_thread::yield();
-				FetchData();
-				std::this_thread::yield();
-			}
-		}
-		if(HasMessage(id)) {
-			if(id == 0) {
-				auto it = received.begin();
-				for(; it!=received.end(); ++it) {
-					if(it->second.size() > 0) {
-						id = it->first;
-						message.Swap(it->second.front());
-						it->second.pop();
-						if(it->second.empty())
-							received.erase(it);
-						return true;
-					} else
-						it = received.erase(it);
-				}
-			} else {
-				auto it = received.find(id);
-				if(it != received.end()) {
-					message.Swap(it->second.front());
-					it->second.pop();
-					if(it->second.empty())
-						received.erase(it);
-					return true;
-				}
-			}
-		}
-		return false;
+		Flush();
+		IoContextWaitFor(context, ioEvent, [&]()->bool {
+				return sock == NULL || InternalHasMessage(id);
+			}, timeoutms);
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		if(id == 0)
+			return inbox.PopAny(message, id);
+		return inbox.Pop(message, id);
 	}
 	
 	bool Socket::PopAnyMessage(Message& message,
@@ -296,29 +2521,128 @@ namespace udp {
 		return InternalPopMessage(message, _id, timeoutms);
 	}
 	
+	bool Socket::InternalPopMessage(FastMessage& message, uint64_t& id,
+			int timeoutms) {
+		Flush();
+		IoContextWaitFor(context, ioEvent, [&]()->bool {
+				return sock == NULL || InternalHasMessage(id);
+			}, timeoutms);
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		if(id == 0)
+			return inbox.PopAny(message, id);
+		return inbox.Pop(message, id);
+	}
+	
+	bool Socket::PopAnyMessage(FastMessage& message, uint64_t& id,
+			int timeoutms) {
+		id = 0;
+		return InternalPopMessage(message, id, timeoutms);
+	}
+	bool Socket::PopMessage(FastMessage& message, const uint64_t id,
+			int timeoutms) {
+		uint64_t _id = id;
+		return InternalPopMessage(message, _id, timeoutms);
+	}
+	
 	
 	void Socket::CloseEndpoint(const GlobalEndpoint& endpoint) {
 		Endpoint end(endpoint);
-		received.erase(endpointId[end]);
-		endpointId.erase(end);
+		CloseEndpoint(end);
 	}
 	
 	void Socket::CloseEndpoint(const Endpoint& endpoint) {
-		received.erase(endpointId[endpoint]);
-		endpointId.erase(endpoint);
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		InternalCloseEndpoint(peers.Find(endpoint));
 	}
 	
 	void Socket::CloseEndpoint(const uint64_t id) {
-		received.erase(id);
-		endpointId.erase(id);
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		InternalCloseEndpoint(id);
+	}
+	
+	void Socket::InternalCloseEndpoint(const uint64_t id) {
+		inbox.Erase(id);
+		peers.Erase(id);
+		if(reassembler)
+			reassembler->Erase(id);
+		if(pmtu)
+			pmtu->peers.Erase(id);
+		if(reliable) {
+			if(ReliableChannel** channel = reliable->channels.Find(id)) {
+				delete *channel;
+				reliable->channels.Erase(id);
+			}
+		}
+	}
+	
+	
+	void Socket::SetPeerLimits(uint32_t maxPeers, int idleTimeoutms) {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		this->maxPeers = std::max<uint32_t>(maxPeers, 1);
+		peerIdleTimeoutms = idleTimeoutms;
+		EvictPeers(std::chrono::steady_clock::now(), 0);
+	}
+	
+	void Socket::SetEvictionCallback(std::function<void(uint64_t id,
+				const GlobalEndpoint& endpoint)> callback) {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		evictionCallback = callback;
+	}
+	
+	void Socket::EvictPeers(PeerTable::TimePoint now, uint64_t keep) {
+		PeerTable::TimePoint lastSeen;
+		while(peers.Size() > maxPeers) {
+			const uint64_t id = peers.Oldest(lastSeen);
+			if(id == keep)
+				break;
+			EvictPeer(id);
+		}
+		if(peerIdleTimeoutms <= 0)
+			return;
+		const auto idle = std::chrono::milliseconds(peerIdleTimeoutms);
+		for(uint64_t id=peers.Oldest(lastSeen); id!=0 && id!=keep &&
+				now-lastSeen>=idle; id=peers.Oldest(lastSeen))
+			EvictPeer(id);
+	}
+	
+	void Socket::EvictPeer(uint64_t id) {
+		if(evictionCallback)
+			evicted.emplace_back(id, *peers.Find(id));
+		InternalCloseEndpoint(id);
+		if(evicted.empty() || evictionPosted || context == NULL)
+			return;
+		// the callback may use the socket, so it runs later and unlocked
+		evictionPosted = true;
+		++pendingHandlers;
+		boost::asio::post(*context, [this]() {
+				std::vector<std::pair<uint64_t, Endpoint>> peers;
+				std::function<void(uint64_t, const GlobalEndpoint&)> callback;
+				{
+					std::lock_guard<std::mutex> lock(ioEvent.mutex);
+					evictionPosted = false;
+					peers.swap(evicted);
+					callback = evictionCallback;
+				}
+				if(callback)
+					for(const auto& it : peers)
+						callback(it.first, (GlobalEndpoint)it.second);
+				std::lock_guard<std::mutex> lock(ioEvent.mutex);
+				--pendingHandlers;
+				ioEvent.Notify();
+			});
 	}
 	
 	
 	uint64_t Socket::PopNextEmptyId() {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		return InternalPopNextEmptyId();
+	}
+	
+	uint64_t Socket::InternalPopNextEmptyId() {
 		while(true) {
 			uint64_t id = ++nextEmptyId;
 			if(id!=0 && id!=(~(uint64_t)(0)))
-				if(endpointId.has(id) == false)
+				if(peers.Find(id) == NULL)
 					return id;
 		}
 		DEBUG("An unknown error appeared in system!");
@@ -326,30 +2650,262 @@ namespace udp {
 	}
 	
 	uint64_t Socket::GetId(const GlobalEndpoint& endpoint) {
-		Endpoint end(endpoint);
-		if(endpointId.has(end))
-			return endpointId[end];
-		else {
-			uint64_t id = PopNextEmptyId();
-			endpointId.insert(end, id);
-			return id;
+		return GetId(Endpoint(endpoint));
+	}
+	
+	uint64_t Socket::GetId(const Endpoint& endpoint) {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		return InternalGetId(endpoint);
+	}
+	
+	uint64_t Socket::InternalGetId(const Endpoint& endpoint) {
+		uint64_t id = peers.Find(endpoint);
+		if(id == 0) {
+			const auto now = std::chrono::steady_clock::now();
+			id = InternalPopNextEmptyId();
+			peers.Insert(endpoint, id, now);
+			EvictPeers(now, id);
 		}
-		return 0;
+		return id;
 	}
 	
 	GlobalEndpoint Socket::GetEndpoint(const uint64_t id) const {
-		if(endpointId.has(id))
-			return (GlobalEndpoint)endpointId[id];
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		const Endpoint* endpoint = peers.Find(id);
+		if(endpoint)
+			return (GlobalEndpoint)*endpoint;
 		return GlobalEndpoint();
 	}
 	
+	uint32_t Socket::GetDatagramSize(const uint64_t id) const {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		if(pmtu)
+			if(const PathMtu::Peer* peer = pmtu->peers.Find(id))
+				return peer->size;
+		return udpMessageSizeLimit;
+	}
+	
+	bool Socket::FindEndpoint(const uint64_t id, Endpoint& endpoint) const {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		const Endpoint* found = peers.Find(id);
+		if(found) {
+			endpoint = *found;
+			return true;
+		}
+		return false;
+	}
+	
+	
+	
+	const uint32_t shardIdShift = 56;
+	const uint32_t maxShards = 256;
+	
+	ShardedSocket::ShardedSocket() :
+		arrivals(0), cursor(0) {
+	}
+	
+	ShardedSocket::~ShardedSocket() {
+		Close();
+	}
+	
+	void ShardedSocket::Open(const GlobalEndpoint& endpoint,
+			uint32_t shardsCount) {
+		Close();
+		uint32_t count = shardsCount;
+		if(count == 0)
+			count = std::max<uint32_t>(1, GetIoThreadsCount());
+#ifndef SO_REUSEPORT
+		count = 1;
+#endif
+		count = std::min(count, maxShards);
+		Endpoint end(endpoint);
+		boost::system::error_code err;
+		for(uint32_t i=0; i<count; ++i) {
+			std::unique_ptr<Socket> shard(new Socket());
+			shard->owner = this;
+			try {
+				shard->Open(end, count > 1);
+			} catch(const boost::system::system_error& e) {
+				fprintf(stderr, "\n Failed to open udp socket shard %u: %s",
+						i, e.what());
+				err = e.code();
+				shard->Close();
+				continue;
+			}
+			// with port 0 the remaining shards share the port picked for the
+			// first one that opened
+			if(shards.empty() && end.port == 0)
+				end = Endpoint(shard->sock->local_endpoint());
+			shards.emplace_back(std::move(shard));
+		}
+		if(shards.empty())
+			throw boost::system::system_error(err);
+	}
+	
+	void ShardedSocket::Close() {
+		for(auto& shard : shards)
+			shard->Close();
+		shards.clear();
+	}
+	
+	uint32_t ShardedSocket::GetShardsCount() const {
+		return shards.size();
+	}
+	
+	Socket& ShardedSocket::GetShard(uint32_t shard) {
+		return *shards[shard];
+	}
+	
+	
+	bool ShardedSocket::Send(const Message& message,
+			const GlobalEndpoint& endpoint) {
+		Endpoint end(endpoint);
+		uint64_t id;
+		Socket* shard = FindShard(end, id);
+		if(shard == NULL) {
+			if(shards.empty())
+				return false;
+			shard = shards.front().get();
+		}
+		return shard->Send(message, end);
+	}
+	
+	bool ShardedSocket::Send(const Message& message, uint64_t id) {
+		uint64_t localId;
+		Socket* shard = Shard(id, localId);
+		return shard ? shard->Send(message, localId) : false;
+	}
+	
+	bool ShardedSocket::SendReliable(const Message& message, uint64_t id) {
+		uint64_t localId;
+		Socket* shard = Shard(id, localId);
+		return shard ? shard->SendReliable(message, localId) : false;
+	}
+	
+	void ShardedSocket::Flush() {
+		for(auto& shard : shards)
+			shard->Flush();
+	}
+	
+	
+	bool ShardedSocket::HasAnyMessage() const {
+		for(auto& shard : shards)
+			if(shard->HasAnyMessage())
+				return true;
+		return false;
+	}
+	
+	bool ShardedSocket::PopAnyMessage(Message& message, uint64_t& id,
+			int timeoutms) {
+		if(shards.empty())
+			return false;
+		const auto deadline = std::chrono::steady_clock::now() +
+			std::chrono::milliseconds(std::max(timeoutms, 0));
+		for(;;) {
+			uint64_t seen;
+			{
+				std::lock_guard<std::mutex> lock(ioEvent.mutex);
+				seen = arrivals;
+			}
+			if(PopFromShards(message, id))
+				return true;
+			// anything queued after seen was read wakes the wait up
+			const int remaining = std::chrono::ceil<
+				std::chrono::milliseconds>(deadline -
+						std::chrono::steady_clock::now()).count();
+			if(!IoContextWaitFor(shards.front()->context, ioEvent,
+						[&]()->bool {
+							return arrivals != seen;
+						}, remaining))
+				return PopFromShards(message, id);
+		}
+	}
+	
+	bool ShardedSocket::PopMessage(Message& message, const uint64_t id,
+			int timeoutms) {
+		uint64_t localId;
+		Socket* shard = Shard(id, localId);
+		return shard ? shard->PopMessage(message, localId, timeoutms) : false;
+	}
+	
+	
+	void ShardedSocket::CloseEndpoint(const uint64_t id) {
+		uint64_t localId;
+		if(Socket* shard = Shard(id, localId))
+			shard->CloseEndpoint(localId);
+	}
+	
+	uint64_t ShardedSocket::GetId(const GlobalEndpoint& endpoint) {
+		Endpoint end(endpoint);
+		uint64_t id;
+		// the kernel picks the shard of a peer, so an id is only known once
+		// it was heard from and reliable messages get acked on that shard
+		if(FindShard(end, id))
+			return id;
+		return 0;
+	}
+	
+	GlobalEndpoint ShardedSocket::GetEndpoint(const uint64_t id) const {
+		uint64_t localId;
+		Socket* shard = Shard(id, localId);
+		return shard ? shard->GetEndpoint(localId) : GlobalEndpoint();
+	}
+	
+	
+	void ShardedSocket::MessageArrived() {
+		std::lock_guard<std::mutex> lock(ioEvent.mutex);
+		++arrivals;
+		ioEvent.Notify();
+	}
+	
+	bool ShardedSocket::PopFromShards(Message& message, uint64_t& id) {
+		const uint32_t count = shards.size();
+		uint32_t first;
+		{
+			std::lock_guard<std::mutex> lock(ioEvent.mutex);
+			first = cursor;
+			cursor = (cursor+1) % count;
+		}
+		// a different shard goes first every time, so none is starved
+		for(uint32_t i=0; i<count; ++i) {
+			const uint32_t shard = (first+i) % count;
+			uint64_t localId;
+			if(shards[shard]->PopAnyMessage(message, localId, 0)) {
+				id = ((uint64_t)shard << shardIdShift) | localId;
+				return true;
+			}
+		}
+		return false;
+	}
+	
+	Socket* ShardedSocket::Shard(uint64_t id, uint64_t& localId) const {
+		const uint64_t shard = id >> shardIdShift;
+		localId = id & ((1ull << shardIdShift) - 1);
+		if(shard >= shards.size())
+			return NULL;
+		return shards[shard].get();
+	}
+	
+	Socket* ShardedSocket::FindShard(const Endpoint& endpoint,
+			uint64_t& id) const {
+		for(uint32_t i=0; i<shards.size(); ++i) {
+			Socket& shard = *shards[i];
+			std::lock_guard<std::mutex> lock(shard.ioEvent.mutex);
+			if(const uint64_t localId = shard.peers.Find(endpoint)) {
+				id = ((uint64_t)i << shardIdShift) | localId;
+				return &shard;
+			}
+		}
+		return NULL;
+	}
+	
 	
 	
 	Connection::Connection(std::shared_ptr<Socket> socket,
 			const GlobalEndpoint& endpoint) :
 		socket(socket),
-		globalEndpoint(endpoint),
-		endpoint(endpoint) {
+		endpoint(endpoint),
+		globalEndpoint(endpoint) {
 		id = socket->GetId(this->endpoint);
 	}
 	
@@ -365,6 +2921,22 @@ namespace udp {
 		return socket->Send(message, endpoint);
 	}
 	
+	bool Connection::SendReliable(const Message& message) {
+		return socket->SendReliable(message, id);
+	}
+	
+	bool Connection::Send(const FastMessage& message) {
+		return socket->Send(message, endpoint);
+	}
+	
+	void Connection::Flush() {
+		socket->Flush();
+	}
+	
+	uint32_t Connection::GetDatagramSize() const {
+		return socket->GetDatagramSize(id);
+	}
+	
 	bool Connection::HasMessage() const {
 		return socket->HasMessage(id);
 	}
@@ -373,6 +2945,10 @@ namespace udp {
 		return socket->PopMessage(message, id, timeoutms);
 	}
 	
+	bool Connection::PopMessage(FastMessage& message, int timeoutms) {
+		return socket->PopMessage(message, id, timeoutms);
+	}
+	
 	bool Connection::operator == (const Connection& r) const {
 		return id==r.id && socket==r.socket;
 	}
@@ -20,6 +20,7 @@
 #define UDP_HPP
 
 #include "ASIO.hpp"
+#include "OpenHashMap.hpp"
 
 #include <string>
 #include <vector>
@@ -29,51 +30,353 @@
 #include <map>
 #include <unordered_map>
 #include <queue>
+#include <deque>
+#include <chrono>
 
 namespace udp {
 	
 	const uint32_t udpMessageSizeLimit = 1280;
 	
+	// largest datagram sent to a peer whose path was probed, a 9000 byte
+	// MTU without IPv4 and UDP headers
+	const uint32_t udpMaxDatagramSize = 8972;
+	const int udpMtuProbeTimeoutms = 500;
+	const uint32_t udpMtuProbeAttempts = 3;
+	const int udpMtuConfirmIntervalms = 30000;
+	const int udpMtuRaiseIntervalms = 600000;
+	
+	const uint32_t udpMaxMessageSize = 256*1024;
+	const uint32_t udpFragmentPoolSize = 1024;
+	const uint32_t udpMaxReassemblies = 64;
+	const uint32_t udpMaxReassembliesPerPeer = 8;
+	const int udpReassemblyTimeoutms = 2000;
+	
+	const int udpAggregationDelayms = 1;
+	
+	// longest a send waits for the io thread to free the batched send queue
+	// before its datagram is dropped
+	const int udpSendQueueWaitms = 100;
+	
+	const uint32_t udpMaxPeers = 65536;
+	const int udpPeerIdleTimeoutms = 0; // peers never expire
+	
+	const int udpCookieLifetimems = 8000;
+	
+	const int reliableInitialRtoms = 200;
+	const int reliableMinRtoms = 20;
+	const int reliableMaxRtoms = 2000;
+	const uint32_t reliableWindow = 256;
+	const uint32_t reliableInitialCwnd = 16;
+	const uint32_t reliableMinCwnd = 4;
+	const uint32_t reliableMaxTransmissions = 16;
+	
 	using GlobalEndpoint = Endpoint;
 	
+	/*
+	 *  Trivially copyable UDP endpoint stored inline. IPv4 addresses take the
+	 *  first four address bytes. The hash is computed once on construction,
+	 *  so the peer table compares addresses only when hashes match.
+	 */
 	class Endpoint {
 	public:
 		
-		Endpoint(bool empty);
-		Endpoint(bool ref, boost::asio::ip::udp::endpoint* ptr);
+		const static uint8_t familyV4 = 4;
+		const static uint8_t familyV6 = 6;
+		
 		Endpoint();
 		Endpoint(const GlobalEndpoint& endpoint);
-		Endpoint(const Endpoint& endpoint);
-		Endpoint(Endpoint&& endpoint) : ptr(endpoint.ptr), ref(endpoint.ref) {}
 		Endpoint(uint16_t port);
-		~Endpoint();
-		
-		static Endpoint MakeEmpty();
-		static Endpoint Make(boost::asio::ip::udp::endpoint* ptr);
+#ifdef CPP_FILES_CPP
+		Endpoint(const boost::asio::ip::udp::endpoint& endpoint);
+		boost::asio::ip::udp::endpoint UdpEndpoint() const;
+#endif
 		
-		Endpoint& operator = (const Endpoint& other);
 		bool operator < (const Endpoint& r) const;
 		bool operator == (const Endpoint& r) const;
 		bool operator != (const Endpoint& r) const;
 		
 		operator GlobalEndpoint() const;
 		
-		boost::asio::ip::udp::endpoint* ptr;
+		inline uint32_t Hash() const { return hash; }
+		
+		uint8_t address[16];
+		uint32_t scopeId;
+		uint16_t port;
+		uint8_t family;
+		uint8_t padding;
+		uint32_t hash;
+		
 	private:
-		bool ref;
+		
+		void ComputeHash();
+	};
+	
+	struct EndpointHash {
+		inline size_t operator()(const Endpoint& endpoint) const {
+			return endpoint.Hash();
+		}
+	};
+	
+	struct IdHash {
+		inline size_t operator()(uint64_t id) const {
+			id ^= id >> 33;
+			id *= 0xff51afd7ed558ccdull;
+			id ^= id >> 33;
+			return id;
+		}
+	};
+	
+	/*
+	 *  Two-way endpoint <-> id map for the peers of a socket, kept in two
+	 *  open addressing tables so that per-datagram lookups do not allocate.
+	 *  Peers are also linked in order of the time they were last seen, so
+	 *  the least recently seen one is found without a scan.
+	 */
+	class PeerTable {
+	public:
+		
+		using TimePoint = std::chrono::steady_clock::time_point;
+		
+		PeerTable();
+		
+		uint64_t Find(const Endpoint& endpoint) const; // 0 when unknown
+		const Endpoint* Find(uint64_t id) const;
+		void Insert(const Endpoint& endpoint, uint64_t id, TimePoint now);
+		// marks the peer as seen now, returns 0 when unknown
+		uint64_t Touch(const Endpoint& endpoint, TimePoint now);
+		void Erase(const Endpoint& endpoint);
+		void Erase(uint64_t id);
+		void Clear();
+		
+		size_t Size() const;
+		// least recently seen peer, 0 when empty
+		uint64_t Oldest(TimePoint& lastSeen) const;
+		
+	private:
+		
+		const static uint32_t none = ~(uint32_t)0;
+		
+		struct Peer {
+			Endpoint endpoint;
+			uint64_t id;
+			TimePoint lastSeen;
+			uint32_t prev;
+			uint32_t next;
+		};
+		
+		void Link(uint32_t peer);
+		void Unlink(uint32_t peer);
+		void Release(uint32_t peer);
+		
+		std::vector<Peer> entries;
+		uint32_t freeEntries;
+		uint32_t head;
+		uint32_t tail;
+		OpenHashMap<Endpoint, uint32_t, EndpointHash> ids;
+		OpenHashMap<uint64_t, uint32_t, IdHash> endpoints;
+	};
+	
+	/*
+	 *  Received messages of a socket. Every message is linked into one list
+	 *  in arrival order and into the list of its peer, so popping the oldest
+	 *  message, or the oldest message of a given peer, is O(1). In fair mode
+	 *  PopAny serves peers with pending messages round-robin instead of in
+	 *  arrival order. Message nodes are reused and Pop swaps buffers with the
+	 *  caller, so a steady stream of messages does not allocate. A
+	 *  FastMessage is copied straight from the node, which keeps its buffers.
+	 */
+	class Inbox {
+	public:
+		
+		Inbox();
+		
+		// returned message stays valid until the next Push
+		Message& Push(uint64_t peer);
+		bool PopAny(Message& message, uint64_t& peer);
+		bool Pop(Message& message, uint64_t peer);
+		bool PopAny(FastMessage& message, uint64_t& peer);
+		bool Pop(FastMessage& message, uint64_t peer);
+		
+		bool Empty() const;
+		bool Has(uint64_t peer) const;
+		
+		void Erase(uint64_t peer);
+		void Clear();
+		
+		void SetFair(bool fair);
+		
+	private:
+		
+		const static uint32_t none = ~(uint32_t)0;
+		
+		struct Node {
+			Message message;
+			uint64_t peer;
+			uint32_t prev;
+			uint32_t next;
+			uint32_t peerNext;
+		};
+		
+		struct PeerQueue {
+			uint64_t peer;
+			uint32_t head;
+			uint32_t tail;
+			uint32_t ringPrev;
+			uint32_t ringNext;
+		};
+		
+		void Unlink(uint32_t node);
+		// queue PopAny takes from, none when empty
+		uint32_t NextQueue(uint64_t& peer);
+		// unlinked node, its message stays valid until the next Push
+		uint32_t TakeHead(uint32_t queue);
+		void ReleaseQueue(uint32_t queue);
+		
+		std::deque<Node> nodes;
+		uint32_t freeNodes;
+		uint32_t head;
+		uint32_t tail;
+		std::vector<PeerQueue> queues;
+		uint32_t freeQueues;
+		OpenHashMap<uint64_t, uint32_t, IdHash> peerQueue;
+		uint32_t cursor;
+		bool fair;
 	};
 	
 	
 	
+	/*
+	 *  Batched I/O, enabled with SetBatching(batchSize > 1). Datagrams are
+	 *  received up to batchSize at once with recvmmsg into a preallocated
+	 *  slab. Sent datagrams are queued and written up to batchSize at once
+	 *  with sendmmsg. The queue is handed to the io thread when it is full,
+	 *  on Flush, before every pop, on Close, and by a handler posted to the
+	 *  io context when the first datagram is queued; new datagrams go to a
+	 *  second queue meanwhile. When the socket buffer is full the unsent
+	 *  datagrams wait until the socket is writable again. Meanwhile Send
+	 *  waits up to udpSendQueueWaitms for the io thread once the second
+	 *  queue is full, the queue grows to take a whole fragmented message
+	 *  more, and it is dropped past that. Where recvmmsg/sendmmsg
+	 *  do not exist the queues are served one datagram per system call.
+	 */
+	struct BatchIo;
+	
+	// delays the next receive after waiting for datagrams failed
+	struct ReceiveBackoff;
+	
+	/*
+	 *  Reliable ordered delivery, per peer, sharing the socket with ordinary
+	 *  datagrams. Reliable datagrams start with a zero byte, which never
+	 *  starts a message frame. Every reliable message gets a sequence number,
+	 *  and the receiver acknowledges the next sequence number it expects plus
+	 *  a bitfield of the 32 numbers after it that it already holds. Messages
+	 *  are retransmitted after an RTO computed from RTT samples of messages
+	 *  that were sent once (RFC 6298, doubled on every timeout), and are
+	 *  delivered to the inbox in order. Messages above a selectively
+	 *  acknowledged one are resent without waiting for the RTO. The number of
+	 *  messages in flight per peer follows a congestion window (slow start,
+	 *  additive increase, halved on loss) capped at reliableWindow, later
+	 *  messages wait. A peer that does not acknowledge a message after
+	 *  reliableMaxTransmissions attempts is closed as with CloseEndpoint and
+	 *  reported to the eviction callback, its sequence numbers cannot be
+	 *  resynchronized. Messages that do not fit one datagram are split into
+	 *  consecutive reliable chunks, which the receiver concatenates as they
+	 *  are delivered.
+	 */
+	struct ReliableState;
+	struct ReliableChannel;
+	
+	/*
+	 *  Messages larger than the peer's datagram size, up to
+	 *  udpMaxMessageSize, are sent as fragments: datagrams of that size
+	 *  starting with a zero byte, the fragment type, a message id, the
+	 *  fragment index and the fragment count. The receiver collects
+	 *  fragments in a pool of udpFragmentPoolSize slots of
+	 *  udpMessageSizeLimit, larger fragments take several slots. The pool
+	 *  is allocated once, when the first fragment arrives. At most
+	 *  udpMaxReassemblies messages, udpMaxReassembliesPerPeer per peer, are
+	 *  assembled at once, the oldest one is dropped to make room, and
+	 *  messages incomplete after udpReassemblyTimeoutms are dropped.
+	 */
+	struct Reassembler;
+	
+	/*
+	 *  With aggregation enabled, frames sent with Send to the same endpoint
+	 *  are packed into one datagram up to the peer's datagram size. A peer's
+	 *  datagram is sent when the next frame does not fit, on Flush, before
+	 *  every pop, and at the latest delayms after its first frame. Receivers
+	 *  read every frame of a datagram, so aggregated and single frame
+	 *  datagrams can be mixed freely. Reliable and fragmented messages are
+	 *  never aggregated.
+	 */
+	struct Aggregator;
+	
+	/*
+	 *  Optional admission gate for unknown peers. A datagram from an address
+	 *  without peer state is answered with a cookie, a SipHash of the
+	 *  address and the current time slot under a random per-socket key, and
+	 *  is dropped. Peer state is created only when the cookie comes back from
+	 *  the same address within udpCookieLifetimems to twice that. Every
+	 *  socket echoes cookies it receives, gated or not. Cookies answer only
+	 *  datagrams at least as large as the cookie datagram, as every reliable
+	 *  datagram is, so the gate does not amplify spoofed traffic. Datagrams
+	 *  sent before admission are lost, reliable ones are retransmitted.
+	 */
+	struct CookieGate;
+	
+	/*
+	 *  Linux segmentation offload. With GSO one sendmsg carries a run of
+	 *  equally sized datagrams to one endpoint (the last may be shorter),
+	 *  which the kernel or the NIC splits: runs come from fragmented
+	 *  messages, and with batching from any consecutive datagrams in the
+	 *  send queue. With GRO the kernel hands over datagrams of one flow
+	 *  coalesced into one buffer, which the receive path splits again; it
+	 *  replaces recvmmsg when both are enabled. Either one is used only when
+	 *  the kernel accepts the socket option, and GSO is turned off again
+	 *  when a segmented send is refused.
+	 */
+	struct Offload;
+	
+	/*
+	 *  Packetization layer path MTU discovery (RFC 8899), enabled with
+	 *  SetPathMtuDiscovery. Datagrams of udpMessageSizeLimit go to every
+	 *  peer. For a peer that is sent to, the socket searches the largest
+	 *  size up to udpMaxDatagramSize that reaches it: probe datagrams padded
+	 *  to the tested size are answered with a short acknowledgement by
+	 *  every socket (probes below udpMessageSizeLimit are ignored, so they
+	 *  cannot amplify spoofed traffic), a probe unanswered after
+	 *  udpMtuProbeAttempts tries of udpMtuProbeTimeoutms is too large. The
+	 *  found size is confirmed every udpMtuConfirmIntervalms while the peer
+	 *  is sent to, when confirmation fails the peer falls back to
+	 *  udpMessageSizeLimit and the search starts over; a new search for a
+	 *  larger size starts every udpMtuRaiseIntervalms. Aggregated and
+	 *  fragmented datagrams use the found size, reliable datagrams keep
+	 *  udpMessageSizeLimit so that retransmissions never depend on it. On
+	 *  Linux the socket sets the don't fragment bit and ignores the kernel's
+	 *  path MTU while enabled, elsewhere probes may pass fragmented by IP.
+	 */
+	struct PathMtu;
+	
+	class ShardedSocket;
+	
 	class Socket {
 	public:
 		
 		Socket();
 		~Socket();
 		
-		void Open(const GlobalEndpoint& endpoint);
+		// reusePort lets several sockets bind the same endpoint, where
+		// SO_REUSEPORT exists
+		void Open(const GlobalEndpoint& endpoint, bool reusePort=false);
 		void Close();
 		
+		void SetBatching(uint32_t batchSize);
+		void SetOffload(bool enable); // call before Open
+		void SetAggregation(bool enable, int delayms=udpAggregationDelayms);
+		bool SetCookieGate(bool enable);
+		void SetPathMtuDiscovery(bool enable);
+		void Flush();
+		
 		bool Send(const std::vector<uint8_t>& buffer, uint64_t id);
 		bool Send(const std::vector<uint8_t>& buffer, const Endpoint& endpoint);
 		bool Send(const std::vector<uint8_t>& buffer,
@@ -81,9 +384,22 @@ namespace udp {
 		bool Send(const Message& message, const GlobalEndpoint& endpoint);
 		bool Send(const Message& message, const Endpoint& endpoint);
 		bool Send(const Message& message, uint64_t id);
+		bool Send(const FastMessage& message, const GlobalEndpoint& endpoint);
+		bool Send(const FastMessage& message, const Endpoint& endpoint);
+		bool Send(const FastMessage& message, uint64_t id);
+		
+		bool SendReliable(const Message& message, const GlobalEndpoint& endpoint);
+		bool SendReliable(const Message& message, const Endpoint& endpoint);
+		bool SendReliable(const Message& message, uint64_t id);
 		
+		// A receive is always armed on the socket's io context, so datagrams
+		// are queued as they arrive. Without io threads FetchData runs the
+		// receive handlers that are ready.
 		void FetchData();
 		bool HasAnyMessage() const;
+		
+		// PopAnyMessage serves peers round-robin instead of in arrival order
+		void SetFairness(bool roundRobin);
 		bool HasMessage(uint64_t id);
 		
 		bool InternalPopMessage(Message& message,
@@ -91,22 +407,186 @@ namespace udp {
 				int timeoutms=-1);
 		bool PopAnyMessage(Message& message, uint64_t& id, int timeoutms=-1);
 		bool PopMessage(Message& message, const uint64_t id, int timeoutms=-1);
+		// A message bigger than maxFastMessageSize is removed and the pop
+		// fails, use the Message overloads where those are expected.
+		bool PopAnyMessage(FastMessage& message, uint64_t& id,
+				int timeoutms=-1);
+		bool PopMessage(FastMessage& message, const uint64_t id,
+				int timeoutms=-1);
 		
 		void CloseEndpoint(const GlobalEndpoint& endpoint);
 		void CloseEndpoint(const Endpoint& endpoint);
 		void CloseEndpoint(const uint64_t id);
 		
+		// Peers not heard from for idleTimeoutms (never when 0) and, above
+		// maxPeers, the least recently heard ones are forgotten as with
+		// CloseEndpoint. The callback runs on the io context without the
+		// socket locked, also for peers closed because they stopped
+		// acknowledging reliable messages.
+		void SetPeerLimits(uint32_t maxPeers, int idleTimeoutms);
+		void SetEvictionCallback(std::function<void(uint64_t id,
+					const GlobalEndpoint& endpoint)> callback);
+		
 		uint64_t PopNextEmptyId();
 		uint64_t GetId(const GlobalEndpoint& endpoint);
+		uint64_t GetId(const Endpoint& endpoint);
 		GlobalEndpoint GetEndpoint(const uint64_t id) const;
+		// largest datagram sent to the peer, at least udpMessageSizeLimit
+		uint32_t GetDatagramSize(const uint64_t id) const;
 		
 	private:
 		
+		friend class ShardedSocket;
+		
+		void StartReceive();
+		void BackOffReceive();
+		void ReceiveCompleted();
+		void ReceivePending();
+		bool InternalHasMessage(uint64_t id) const;
+		bool InternalPopMessage(FastMessage& message, uint64_t& id,
+				int timeoutms);
+		uint64_t InternalGetId(const Endpoint& endpoint);
+		uint64_t InternalPopNextEmptyId();
+		bool FindEndpoint(const uint64_t id, Endpoint& endpoint) const;
+		void InternalCloseEndpoint(const uint64_t id);
+		void EvictPeers(PeerTable::TimePoint now, uint64_t keep);
+		void EvictPeer(uint64_t id);
+		void ReceiveDatagram(const Endpoint& endpoint, uint8_t* data,
+				size_t size);
+		void ReceiveFragment(uint64_t id, const uint8_t* data, size_t size);
+		bool PassCookieGate(const Endpoint& endpoint, const uint8_t* data,
+				size_t size);
+		void EchoCookie(const Endpoint& endpoint, const uint8_t* data,
+				size_t size);
+		bool SendFragmented(const Endpoint& endpoint, const uint8_t* data,
+				size_t size, size_t datagramSize);
+		uint8_t* Aggregate(const Endpoint& endpoint, size_t size,
+				size_t datagramSize);
+		void FlushAggregated(const Endpoint* endpoint);
+		void ArmAggregation();
+		void FetchBatch();
+		void ApplyOffload();
+		void FetchOffload();
+		void ApplyMtuDiscovery();
+		size_t InternalDatagramSize(const Endpoint& endpoint);
+		void ProbePeer(uint64_t id, PeerTable::TimePoint now);
+		void SendMtuProbe(const Endpoint& endpoint, uint64_t id,
+				PeerTable::TimePoint now);
+		void AnswerMtuProbe(const Endpoint& endpoint, const uint8_t* data,
+				size_t size);
+		void ReceiveMtuAck(uint64_t id, const uint8_t* data, size_t size);
+		void ArmMtuProbe();
+		void ProbeMtu();
+		bool SendSegmented(const Endpoint& endpoint, const uint8_t* data,
+				size_t size, size_t segmentSize);
+		uint8_t* QueueDatagram(const Endpoint& endpoint, size_t size);
+		void DatagramQueued();
+		void FlushSendQueue();
+		void SendQueued();
+		void WaitWritable();
+		bool SendDatagram(const Endpoint& endpoint, const uint8_t* data,
+				size_t size);
+		
+		void QueueFrame(uint64_t id, const uint8_t* data, size_t size);
+		ReliableChannel& InternalChannel(uint64_t id);
+		void ReceiveReliable(uint64_t id, const uint8_t* data, size_t size);
+		void DeliverReliable(uint64_t id, ReliableChannel& channel,
+				const uint8_t* data, size_t size);
+		void AcknowledgeReliable(ReliableChannel& channel, uint32_t ack,
+				uint32_t bits);
+		void TransmitReliable(ReliableChannel& channel);
+		void SendReliableAcks();
+		void ArmRetransmission();
+		void Retransmit();
+		
+#ifdef CPP_FILES_CPP
+		template<size_t N>
+		bool SendBuffers(const std::array<boost::asio::const_buffer, N>& buffers,
+				const Endpoint& endpoint);
+#endif
+		
 		uint64_t nextEmptyId;
 		boost::asio::ip::udp::socket* sock;
-		std::unordered_map<uint64_t, std::queue<Message>> received;
-		BiMap<Endpoint, uint64_t> endpointId;
-		uint8_t recvTempBuffer[udpMessageSizeLimit];
+		boost::asio::io_context* context;
+		mutable IoEvent ioEvent;
+		uint32_t pendingHandlers;
+		Inbox inbox;
+		PeerTable peers;
+		boost::asio::ip::udp::endpoint* recvEndpoint;
+		uint8_t recvTempBuffer[udpMaxDatagramSize];
+		std::unique_ptr<BatchIo> batch;
+		std::unique_ptr<ReceiveBackoff> receiveBackoff;
+		bool flushScheduled;
+		std::unique_ptr<ReliableState> reliable;
+		std::unique_ptr<Reassembler> reassembler;
+		std::unique_ptr<Aggregator> aggregator;
+		std::unique_ptr<CookieGate> cookies;
+		std::unique_ptr<Offload> offload;
+		std::unique_ptr<PathMtu> pmtu;
+		std::vector<uint8_t> fragmentBuffer;
+		uint32_t nextFragmentedId;
+		uint32_t maxPeers;
+		int peerIdleTimeoutms;
+		std::function<void(uint64_t, const GlobalEndpoint&)> evictionCallback;
+		std::vector<std::pair<uint64_t, Endpoint>> evicted;
+		bool evictionPosted;
+		ShardedSocket* owner;
+	};
+	
+	
+	
+	/*
+	 *  One logical UDP endpoint served by several Sockets bound to the same
+	 *  address with SO_REUSEPORT (shardsCount 0 means one per io thread).
+	 *  The kernel keeps every remote address on one shard. Each shard runs
+	 *  on its own pool context with its own peer table and inbox, and can be
+	 *  configured on its own through GetShard. Peer ids carry the shard
+	 *  number in their top 8 bits. A peer gets an id only after it was heard
+	 *  from, on the shard its datagrams arrive at: GetId returns 0 for an
+	 *  endpoint that was only sent to, so reliable messages and their
+	 *  acknowledgements never cross shards. Where SO_REUSEPORT does not exist
+	 *  a single shard is used. With port 0 all shards share the port picked
+	 *  for the first one. Shards that fail to open are dropped, Open throws
+	 *  boost::system::system_error when none could.
+	 */
+	class ShardedSocket {
+	public:
+		
+		ShardedSocket();
+		~ShardedSocket();
+		
+		void Open(const GlobalEndpoint& endpoint, uint32_t shardsCount=0);
+		void Close();
+		
+		uint32_t GetShardsCount() const;
+		Socket& GetShard(uint32_t shard);
+		
+		bool Send(const Message& message, const GlobalEndpoint& endpoint);
+		bool Send(const Message& message, uint64_t id);
+		bool SendReliable(const Message& message, uint64_t id);
+		void Flush();
+		
+		bool HasAnyMessage() const;
+		bool PopAnyMessage(Message& message, uint64_t& id, int timeoutms=-1);
+		bool PopMessage(Message& message, const uint64_t id, int timeoutms=-1);
+		
+		void CloseEndpoint(const uint64_t id);
+		uint64_t GetId(const GlobalEndpoint& endpoint);
+		GlobalEndpoint GetEndpoint(const uint64_t id) const;
+		
+	private:
+		
+		friend class Socket;
+		
+		void MessageArrived();
+		bool PopFromShards(Message& message, uint64_t& id);
+		Socket* Shard(uint64_t id, uint64_t& localId) const;
+		Socket* FindShard(const Endpoint& endpoint, uint64_t& id) const;
+		
+		std::vector<std::unique_ptr<Socket>> shards;
+		mutable IoEvent ioEvent;
+		uint64_t arrivals;
+		uint32_t cursor;
 	};
 	
 	
@@ -120,9 +600,14 @@ namespace udp {
 		
 		bool Send(const std::vector<uint8_t>& buffer);
 		bool Send(const Message& message);
+		bool SendReliable(const Message& message);
+		bool Send(const FastMessage& message);
+		void Flush();
+		uint32_t GetDatagramSize() const;
 		
 		bool HasMessage() const;
 		bool PopMessage(Message& message, int timeoutms=-1);
+		bool PopMessage(FastMessage& message, int timeoutms=-1);
 		
 		inline bool operator == (const Connection& r) const;
 		inline bool operator != (const Connection& r) const;
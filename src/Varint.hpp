@@ -0,0 +1,177 @@
+/*
+ *  This file is part of ICon3. Please see README for details.
+ *  Copyright (C) 2020 Marek Zalewski aka Drwalin
+ *
+ *  ICon3 is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ICon3 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef VARINT_HPP
+#define VARINT_HPP
+
+#include <cinttypes>
+#include <cstddef>
+#include <cstring>
+
+#ifdef __BMI2__
+# include <immintrin.h>
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+# define VARINT_WORD_ACCESS
+#endif
+
+/*
+ *  Varint codec of frame lengths: seven bits per byte starting with the
+ *  lowest ones, the top bit set on every byte but the last. The encoded
+ *  size comes from the count of leading zeros. Where bytes can be read as
+ *  little endian words, varints are written as one word and the last byte
+ *  of a varint is found with one mask over eight bytes. The seven bit
+ *  groups are spread and gathered with pdep and pext when BMI2 is enabled
+ *  at compile time (-mbmi2), or with three shift and mask steps otherwise.
+ *  Only values of 2^56 and above take more than eight bytes, those are
+ *  handled byte by byte.
+ */
+namespace varint {
+	
+	const size_t maxBytes = 10;
+	
+	struct Frame {
+		size_t offset;
+		size_t headerSize;
+		uint64_t bodySize;
+	};
+	
+	// ceil(bits/7) for 1 to 64 significant bits
+	inline size_t Size(uint64_t value) {
+		const uint32_t bits = 64 - __builtin_clzll(value|1);
+		return (bits*9 + 64) >> 6;
+	}
+	
+	// spreads the low 56 bits of value into seven bit groups, one per byte
+	inline uint64_t Scatter(uint64_t value) {
+#ifdef __BMI2__
+		return _pdep_u64(value, 0x7F7F7F7F7F7F7F7Full);
+#else
+		value = (value & 0x000000000FFFFFFFull) |
+			((value & 0x00FFFFFFF0000000ull) << 4);
+		value = (value & 0x00003FFF00003FFFull) |
+			((value & 0x0FFFC0000FFFC000ull) << 2);
+		return (value & 0x007F007F007F007Full) |
+			((value & 0x3F803F803F803F80ull) << 1);
+#endif
+	}
+	
+	// Writes Size(value) bytes and returns their count. out has to have
+	// room for maxBytes, bytes after the varint may be overwritten.
+	inline size_t Encode(uint64_t value, uint8_t* out) {
+		const size_t size = Size(value);
+#ifdef VARINT_WORD_ACCESS
+		if(size <= 8) {
+			const uint64_t more = 0x8080808080808080ull &
+				((1ull << (size*8-8)) - 1);
+			const uint64_t word = Scatter(value) | more;
+			memcpy(out, &word, 8);
+			return size;
+		}
+#endif
+		for(size_t i=1; i<size; ++i) {
+			*out++ = (uint8_t)value | 0x80;
+			value >>= 7;
+		}
+		*out = (uint8_t)value;
+		return size;
+	}
+	
+	// packs the low seven bits of every byte of word
+	inline uint64_t Gather(uint64_t word) {
+#ifdef __BMI2__
+		return _pext_u64(word, 0x7F7F7F7F7F7F7F7Full);
+#else
+		word &= 0x7F7F7F7F7F7F7F7Full;
+		word = (word & 0x007F007F007F007Full) |
+			((word & 0x7F007F007F007F00ull) >> 1);
+		word = (word & 0x00003FFF00003FFFull) |
+			((word & 0x3FFF00003FFF0000ull) >> 2);
+		return (word & 0x000000000FFFFFFFull) |
+			((word & 0x0FFFFFFF00000000ull) >> 4);
+#endif
+	}
+	
+	// Reads a varint from at most size bytes of data. Returns the bytes
+	// taken, or 0 when its last byte is not within size and maxBytes.
+	inline size_t Decode(const uint8_t* data, size_t size, uint64_t& value) {
+#ifdef VARINT_WORD_ACCESS
+		if(size >= 8) {
+			uint64_t word;
+			memcpy(&word, data, 8);
+			const uint64_t last = ~word & 0x8080808080808080ull;
+			if(last) {
+				// keeps every bit up to the top bit of the last byte
+				value = Gather(word & (last ^ (last-1)));
+				return (__builtin_ctzll(last)+1) >> 3;
+			}
+			value = Gather(word);
+			for(size_t i=8; i<size && i<maxBytes; ++i) {
+				value |= ((uint64_t)data[i]&0x7F) << (i*7);
+				if((data[i]&0x80) == 0)
+					return i+1;
+			}
+			return 0;
+		}
+#endif
+		uint64_t result = 0;
+		for(size_t i=0; i<size && i<maxBytes; ++i) {
+			result |= ((uint64_t)data[i]&0x7F) << (i*7);
+			if((data[i]&0x80) == 0) {
+				value = result;
+				return i+1;
+			}
+		}
+		return 0;
+	}
+	
+	// Finds up to maxFrames complete frames, a varint body size and the
+	// body, back to back from the start of data, and returns how many.
+	// missing gets the bytes the next frame still lacks, 1 while its header
+	// is incomplete, or 0 when data ends with a frame or maxFrames were
+	// found.
+	inline size_t ScanFrames(const uint8_t* data, size_t size, Frame* frames,
+			size_t maxFrames, uint64_t& missing) {
+		size_t count = 0;
+		size_t offset = 0;
+		missing = 0;
+		while(count < maxFrames && offset < size) {
+			uint64_t body;
+			const size_t header = Decode(data+offset, size-offset, body);
+			if(header == 0) {
+				missing = 1;
+				break;
+			}
+			const size_t available = size - offset - header;
+			if(body > available) {
+				missing = body - available;
+				break;
+			}
+			frames[count].offset = offset;
+			frames[count].headerSize = header;
+			frames[count].bodySize = body;
+			++count;
+			offset += header + body;
+		}
+		return count;
+	}
+};
+
+#endif
+
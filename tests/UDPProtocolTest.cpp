@@ -0,0 +1,310 @@
+/*
+ *  Loopback tests of the udp::Socket protocol: reliable delivery under loss
+ *  and reordering, fragment reassembly, aggregated frames and the cookie
+ *  gate. Datagrams are captured and replayed with plain asio sockets, the
+ *  exit code is the number of failed checks.
+ */
+
+#define CPP_FILES_CPP
+#include <boost/asio.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <UDP.hpp>
+
+using RawSocket = boost::asio::ip::udp::socket;
+using RawEndpoint = boost::asio::ip::udp::endpoint;
+using Datagram = std::vector<uint8_t>;
+
+int failures = 0;
+
+void Check(bool ok, const char* what) {
+	printf("\n %s: %s", ok ? "ok" : "FAILED", what);
+	if(!ok)
+		++failures;
+}
+
+RawEndpoint Loopback(uint16_t port) {
+	return RawEndpoint(boost::asio::ip::make_address("127.0.0.1"), port);
+}
+
+std::string DataString(const Message& message) {
+	if(message.data.empty())
+		return "";
+	return (const char*)message.data.data();
+}
+
+// Waits up to timeoutms for the first datagram, then takes the ones that
+// follow within a few milliseconds. sender keeps its io handlers running.
+std::vector<Datagram> ReceiveDatagrams(RawSocket& socket, udp::Socket& sender,
+		int timeoutms) {
+	std::vector<Datagram> datagrams;
+	auto deadline = std::chrono::steady_clock::now() +
+		std::chrono::milliseconds(timeoutms);
+	uint8_t buffer[udp::udpMaxDatagramSize];
+	while(std::chrono::steady_clock::now() < deadline) {
+		sender.FetchData();
+		RawEndpoint from;
+		boost::system::error_code err;
+		const size_t size = socket.receive_from(boost::asio::buffer(buffer),
+				from, 0, err);
+		if(err) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+		datagrams.emplace_back(buffer, buffer+size);
+		deadline = std::chrono::steady_clock::now() +
+			std::chrono::milliseconds(50);
+	}
+	return datagrams;
+}
+
+void SendDatagrams(RawSocket& socket, const std::vector<Datagram>& datagrams,
+		const RawEndpoint& to) {
+	for(const Datagram& datagram : datagrams)
+		socket.send_to(boost::asio::buffer(datagram), to);
+}
+
+// Forwards datagrams between the socket on portA and the one listening on
+// b, dropping every 7th and delaying every 5th behind the next one.
+void RunLossyProxy(uint16_t portA, uint16_t portB, RawEndpoint b,
+		std::atomic<bool>& stop) {
+	boost::asio::io_context io;
+	RawSocket sides[2] = {RawSocket(io, Loopback(portA)),
+		RawSocket(io, Loopback(portB))};
+	sides[0].non_blocking(true);
+	sides[1].non_blocking(true);
+	RawEndpoint a;
+	Datagram held;
+	int heldSide = 0;
+	auto heldAt = std::chrono::steady_clock::now();
+	uint32_t counter = 0;
+	uint8_t buffer[udp::udpMaxDatagramSize];
+	auto forward = [&](int side, const Datagram& datagram) {
+		boost::system::error_code err;
+		// what came in on one side leaves through the other
+		sides[1-side].send_to(boost::asio::buffer(datagram), side ? a : b, 0,
+				err);
+	};
+	while(!stop) {
+		bool any = false;
+		for(int side=0; side<2; ++side) {
+			RawEndpoint from;
+			boost::system::error_code err;
+			const size_t size = sides[side].receive_from(
+					boost::asio::buffer(buffer), from, 0, err);
+			if(err)
+				continue;
+			any = true;
+			if(side == 0)
+				a = from;
+			++counter;
+			if(counter%7 == 0)
+				continue;
+			Datagram datagram(buffer, buffer+size);
+			if(counter%5 == 0 && held.empty()) {
+				held.swap(datagram);
+				heldSide = side;
+				heldAt = std::chrono::steady_clock::now();
+				continue;
+			}
+			forward(side, datagram);
+			if(!held.empty()) {
+				forward(heldSide, held);
+				held.clear();
+			}
+		}
+		if(!held.empty() && std::chrono::steady_clock::now()-heldAt >
+				std::chrono::milliseconds(2)) {
+			forward(heldSide, held);
+			held.clear();
+		}
+		if(!any)
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+}
+
+void TestReliableUnderLoss() {
+	std::atomic<bool> stop(false);
+	std::thread proxy(RunLossyProxy, 27401, 27403, Loopback(27402),
+			std::ref(stop));
+	udp::Socket a, b;
+	a.Open(Endpoint("127.0.0.1", 27400));
+	b.Open(Endpoint("127.0.0.1", 27402));
+	
+	const int count = 500;
+	for(int i=0; i<count; ++i)
+		a.SendReliable(Message("reliable", std::to_string(i)),
+				Endpoint("127.0.0.1", 27401));
+	int received = 0;
+	bool ordered = true;
+	Message message;
+	uint64_t id;
+	const auto deadline = std::chrono::steady_clock::now() +
+		std::chrono::seconds(20);
+	while(received < count && std::chrono::steady_clock::now() < deadline) {
+		if(!b.PopAnyMessage(message, id, 100)) {
+			a.FetchData();
+			continue;
+		}
+		if(DataString(message) != std::to_string(received))
+			ordered = false;
+		++received;
+	}
+	Check(received == count,
+			"reliable messages arrive through loss and reordering");
+	Check(ordered, "reliable messages arrive in the order they were sent");
+	
+	a.Close();
+	b.Close();
+	stop = true;
+	proxy.join();
+}
+
+void TestFragmentReassembly() {
+	boost::asio::io_context io;
+	RawSocket raw(io, Loopback(27411));
+	raw.non_blocking(true);
+	udp::Socket a, b;
+	a.Open(Endpoint("127.0.0.1", 27410));
+	b.Open(Endpoint("127.0.0.1", 27412));
+	
+	std::vector<uint8_t> payload(20000);
+	for(size_t i=0; i<payload.size(); ++i)
+		payload[i] = i*7 + i/256;
+	a.Send(Message("fragmented", payload), Endpoint("127.0.0.1", 27411));
+	std::vector<Datagram> fragments = ReceiveDatagrams(raw, a, 2000);
+	Check(fragments.size() > 2, "a large message is sent as fragments");
+	
+	// the last fragment arrives first, the others in order after it
+	if(!fragments.empty())
+		std::rotate(fragments.begin(), fragments.end()-1, fragments.end());
+	SendDatagrams(raw, fragments, Loopback(27412));
+	Message message;
+	uint64_t id;
+	const bool popped = b.PopAnyMessage(message, id, 2000);
+	Check(popped && message.title == "fragmented" && message.data == payload,
+			"fragments received out of order are reassembled");
+	Check(!b.PopAnyMessage(message, id, 50),
+			"a reassembled message is delivered once");
+	
+	a.Close();
+	b.Close();
+}
+
+void TestAggregatedFrames() {
+	boost::asio::io_context io;
+	RawSocket raw(io, Loopback(27421));
+	raw.non_blocking(true);
+	udp::Socket a, b;
+	a.Open(Endpoint("127.0.0.1", 27420));
+	b.Open(Endpoint("127.0.0.1", 27422));
+	a.SetAggregation(true, 1000);
+	
+	const int count = 50;
+	for(int i=0; i<count; ++i)
+		a.Send(Message("aggregated", std::to_string(i)),
+				Endpoint("127.0.0.1", 27421));
+	a.Flush();
+	std::vector<Datagram> datagrams = ReceiveDatagrams(raw, a, 2000);
+	Check(!datagrams.empty() && datagrams.size() < (size_t)count,
+			"small messages share datagrams");
+	
+	SendDatagrams(raw, datagrams, Loopback(27422));
+	int received = 0;
+	bool ordered = true;
+	Message message;
+	uint64_t id;
+	while(received < count && b.PopAnyMessage(message, id, 1000)) {
+		if(message.title != "aggregated" ||
+				DataString(message) != std::to_string(received))
+			ordered = false;
+		++received;
+	}
+	Check(received == count && ordered,
+			"aggregated datagrams split back into the original messages");
+	
+	a.Close();
+	b.Close();
+}
+
+void TestCookieGate() {
+	// control datagram: zero byte, type, 12 byte cookie
+	const size_t cookieDatagramSize = 14;
+	const uint8_t cookieChallenge = 4;
+	const uint8_t cookieEcho = 5;
+	
+	boost::asio::io_context io;
+	RawSocket raw(io, Loopback(27431));
+	raw.non_blocking(true);
+	udp::Socket server, client;
+	server.Open(Endpoint("127.0.0.1", 27432));
+	client.Open(Endpoint("127.0.0.1", 27430));
+	Check(server.SetCookieGate(true), "the cookie gate is enabled");
+	
+	std::vector<uint8_t> frame;
+	CreateOptimalBuffer(Message("gated", "padding to the cookie size"), frame);
+	SendDatagrams(raw, {frame}, Loopback(27432));
+	std::vector<Datagram> answers = ReceiveDatagrams(raw, server, 1000);
+	const bool challenged = answers.size() == 1 &&
+		answers[0].size() == cookieDatagramSize && answers[0][0] == 0 &&
+		answers[0][1] == cookieChallenge;
+	Check(challenged, "an unknown peer is answered with a challenge");
+	Message message;
+	uint64_t id;
+	Check(!server.PopAnyMessage(message, id, 50),
+			"a peer without a cookie is not admitted");
+	
+	Datagram forged(cookieDatagramSize, 0x5A);
+	forged[0] = 0;
+	forged[1] = cookieEcho;
+	SendDatagrams(raw, {forged, frame}, Loopback(27432));
+	ReceiveDatagrams(raw, server, 200);
+	Check(!server.PopAnyMessage(message, id, 50),
+			"a forged cookie does not admit a peer");
+	
+	if(challenged) {
+		Datagram echo = answers[0];
+		echo[1] = cookieEcho;
+		SendDatagrams(raw, {echo, frame}, Loopback(27432));
+		const bool popped = server.PopAnyMessage(message, id, 1000);
+		Check(popped && message.title == "gated",
+				"an echoed cookie admits the peer");
+	}
+	
+	// udp::Socket answers challenges by itself
+	for(int i=0; i<10; ++i)
+		client.SendReliable(Message("client", std::to_string(i)),
+				Endpoint("127.0.0.1", 27432));
+	int received = 0;
+	const auto deadline = std::chrono::steady_clock::now() +
+		std::chrono::seconds(5);
+	while(received < 10 && std::chrono::steady_clock::now() < deadline) {
+		if(!server.PopAnyMessage(message, id, 50)) {
+			client.FetchData();
+			continue;
+		}
+		if(message.title == "client")
+			++received;
+	}
+	Check(received == 10, "a udp::Socket client passes the cookie gate");
+	
+	server.Close();
+	client.Close();
+}
+
+int main() {
+	TestReliableUnderLoss();
+	TestFragmentReassembly();
+	TestAggregatedFrames();
+	TestCookieGate();
+	printf("\n %i checks failed\n", failures);
+	return failures;
+}
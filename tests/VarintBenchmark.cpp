@@ -0,0 +1,258 @@
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include <Varint.hpp>
+#include <FrameParser.hpp>
+
+// NumberBuffer as it encoded and decoded frame sizes before Varint.hpp. Its
+// methods were defined in ASIO.cpp, so calls to them were never inlined.
+#define LEGACY __attribute__((noinline))
+class LegacyNumberBuffer {
+public:
+	
+	LEGACY size_t GetOccupiedBytes() const {
+		int i=0;
+		for(; i<10 && bytes[i]&128; ++i) {
+		}
+		return i+1;
+	}
+	
+	LEGACY size_t SetValue(uint64_t val) {
+		value = val;
+		for(int i=0; i<10; ++i)
+			bytes[i] = 0;
+		
+		size_t i = 0;
+		if(val == 0) {
+			bytes[0] = 0;
+			return 1;
+		}
+		while(val > 0) {
+			if(val > 127) {
+				bytes[i] = (uint8_t)(val&127) | 128;
+			} else {
+				bytes[i] = (uint8_t)(val&127);
+				break;
+			}
+			val >>= 7;
+			++i;
+		}
+		return i+1;
+	}
+	
+	LEGACY size_t SetBytes(const uint8_t* data, size_t max) {
+		value = 0;
+		if(max > 10)
+			max = 10;
+		for(size_t i=0; i<max; ++i)
+			bytes[i] = data[i];
+		size_t i = 0;
+		for(;; ++i) {
+			if(i >= max)
+				return 0;
+			value |= ((uint64_t)bytes[i]&0x7F) << (i*7);
+			if((bytes[i]&128) == 0)
+				break;
+		}
+		return i+1;
+	}
+	
+	uint64_t value;
+	uint8_t bytes[10];
+};
+
+// frame sizes as seen on the wire: mostly small, some up to a few MiB
+std::vector<uint64_t> MakeValues(size_t count, bool anyWidth) {
+	std::mt19937_64 random(12345);
+	std::vector<uint64_t> values(count);
+	for(uint64_t& value : values) {
+		if(anyWidth)
+			value = random() >> (random()%64);
+		else
+			value = random() % (random()%8 ? 1500 : 4*1024*1024);
+	}
+	return values;
+}
+
+bool Verify() {
+	std::mt19937_64 random(777);
+	uint8_t encoded[16];
+	uint8_t buffer[16];
+	for(uint64_t value : MakeValues(1000000, true)) {
+		LegacyNumberBuffer legacy;
+		const size_t size = legacy.SetValue(value);
+		memset(encoded, 0xAA, sizeof(encoded));
+		if(varint::Encode(value, encoded) != size ||
+				varint::Size(value) != size ||
+				memcmp(encoded, legacy.bytes, size) != 0) {
+			printf("\n encode mismatch for %llu", (unsigned long long)value);
+			return false;
+		}
+	}
+	// arbitrary bytes, including truncated and overlong varints
+	for(int i=0; i<1000000; ++i) {
+		for(uint8_t& byte : buffer)
+			byte = random() & (random()%4 ? 0xFF : 0x7F);
+		const size_t max = random()%sizeof(buffer);
+		LegacyNumberBuffer legacy;
+		const size_t size = legacy.SetBytes(buffer, max);
+		uint64_t value = 0;
+		if(varint::Decode(buffer, max, value) != size ||
+				(size && value != legacy.value)) {
+			printf("\n decode mismatch at %i", i);
+			return false;
+		}
+	}
+	return true;
+}
+
+template<typename F>
+void Measure(const char* name, size_t operations, F function) {
+	const auto begin = std::chrono::steady_clock::now();
+	const uint64_t sink = function();
+	const double ns = std::chrono::duration<double, std::nano>(
+			std::chrono::steady_clock::now() - begin).count();
+	printf("\n %-32s %7.3f ns/op   (%llx)", name, ns/operations,
+			(unsigned long long)sink);
+}
+
+int main() {
+	printf("\n BMI2: %s",
+#ifdef __BMI2__
+			"yes"
+#else
+			"no"
+#endif
+			);
+	if(!Verify())
+		return 1;
+	printf("\n varint matches NumberBuffer");
+	
+	const size_t rounds = 20;
+	const std::vector<uint64_t> values = MakeValues(1000000, false);
+	const size_t operations = rounds * values.size();
+	
+	Measure("encode NumberBuffer", operations, [&]() {
+			uint64_t sink = 0;
+			LegacyNumberBuffer buffer;
+			for(size_t r=0; r<rounds; ++r)
+				for(uint64_t value : values)
+					sink += buffer.SetValue(value) + buffer.bytes[0];
+			return sink;
+		});
+	Measure("encode varint", operations, [&]() {
+			uint64_t sink = 0;
+			uint8_t bytes[varint::maxBytes];
+			for(size_t r=0; r<rounds; ++r)
+				for(uint64_t value : values)
+					sink += varint::Encode(value, bytes) + bytes[0];
+			return sink;
+		});
+	
+	// back to back frames with bodies of up to 63 bytes, as in aggregated
+	// datagrams and bursts of small TCP messages
+	std::vector<uint8_t> stream;
+	for(uint64_t value : values) {
+		LegacyNumberBuffer buffer;
+		const size_t size = buffer.SetValue(value % 64);
+		stream.insert(stream.end(), buffer.bytes, buffer.bytes+size);
+		stream.resize(stream.size() + value%64);
+	}
+	const std::vector<uint8_t> headers = [&]() {
+			std::vector<uint8_t> headers;
+			for(uint64_t value : values) {
+				uint8_t bytes[varint::maxBytes];
+				headers.insert(headers.end(), bytes,
+						bytes+varint::Encode(value, bytes));
+			}
+			headers.resize(headers.size()+varint::maxBytes);
+			return headers;
+		}();
+	
+	Measure("decode NumberBuffer", operations, [&]() {
+			uint64_t sink = 0;
+			LegacyNumberBuffer buffer;
+			for(size_t r=0; r<rounds; ++r)
+				for(size_t offset=0; offset+varint::maxBytes<headers.size();) {
+					offset += buffer.SetBytes(&headers[offset],
+							headers.size()-offset);
+					sink += buffer.value;
+				}
+			return sink;
+		});
+	Measure("decode varint", operations, [&]() {
+			uint64_t sink = 0;
+			for(size_t r=0; r<rounds; ++r)
+				for(size_t offset=0; offset+varint::maxBytes<headers.size();) {
+					uint64_t value = 0;
+					offset += varint::Decode(&headers[offset],
+							headers.size()-offset, value);
+					sink += value;
+				}
+			return sink;
+		});
+	
+	// the receive path checked a frame with CanReadFullMessage and then
+	// parsed its header again in TryReadMessageFromBuffer
+	Measure("scan frames NumberBuffer", operations, [&]() {
+			uint64_t sink = 0;
+			for(size_t r=0; r<rounds; ++r) {
+				for(size_t offset=0; offset<stream.size();) {
+					LegacyNumberBuffer check;
+					size_t size = check.SetBytes(&stream[offset],
+							stream.size()-offset);
+					if(size == 0 || stream.size()-offset <
+							check.value+size)
+						break;
+					LegacyNumberBuffer read;
+					size = read.SetBytes(&stream[offset],
+							stream.size()-offset);
+					sink += read.value;
+					offset += size + read.value;
+				}
+			}
+			return sink;
+		});
+	Measure("scan frames varint", operations, [&]() {
+			uint64_t sink = 0;
+			varint::Frame frames[64];
+			for(size_t r=0; r<rounds; ++r) {
+				size_t offset = 0;
+				size_t count;
+				do {
+					uint64_t missing;
+					count = varint::ScanFrames(&stream[offset],
+							stream.size()-offset, frames, 64, missing);
+					for(size_t i=0; i<count; ++i)
+						sink += frames[i].bodySize;
+					if(count)
+						offset += frames[count-1].offset +
+							frames[count-1].headerSize +
+							frames[count-1].bodySize;
+				} while(count == 64);
+			}
+			return sink;
+		});
+	// also finds the title of every frame
+	Measure("scan frames FrameParser", operations, [&]() {
+			uint64_t sink = 0;
+			FrameParser parser;
+			for(size_t r=0; r<rounds; ++r) {
+				for(size_t offset=0; offset<stream.size();) {
+					offset += parser.Feed(&stream[offset],
+							stream.size()-offset);
+					if(parser.GetState() != FrameParser::complete)
+						break;
+					sink += parser.GetBodySize() + parser.GetTitleSize();
+					parser.Reset();
+				}
+			}
+			return sink;
+		});
+	printf("\n");
+	return 0;
+}
+